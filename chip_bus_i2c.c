@@ -0,0 +1,259 @@
+/*
+ * Chip I2C Driver - I2C transport
+ *
+ * Copyright (C) 2014 Vergil Cola (vpcola@gmail.com)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * The MCP23017 sits on 0x21 of the i2c bus. This file only moves
+ * bytes, everything else is done by chip_core.c.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/i2c.h>
+#include <linux/input.h>
+#include <linux/math64.h>
+#include <linux/of.h>
+#include <linux/time.h>
+
+#include "chip_core.h"
+
+/* Define the addresses to scan. Of course, we know that our
+ * hardware is found on 0x21, the chip_i2c_detect() function
+ * below is used by the kernel to enumerate the i2c bus, the function
+ * returns 0 for success or -ENODEV if the device is not found.
+ * The kernel enumerates this array for i2c addresses. This
+ * structure is also passed as a member to the i2c_driver struct.
+ **/
+static const unsigned short normal_i2c[] = { 0x20, 0x21, I2C_CLIENT_END };
+
+/* Our drivers id table */
+static const struct i2c_device_id chip_i2c_id[] = {
+    { "chip_i2c", 0 },
+    {}
+};
+
+MODULE_DEVICE_TABLE(i2c, chip_i2c_id);
+
+/* The register accessors, we use the smbus byte and block
+ * transfers (i2c.h) of the client.
+ */
+static int chip_bus_i2c_read(void *priv, u8 reg)
+{
+    return i2c_smbus_read_byte_data(priv, reg);
+}
+
+static int chip_bus_i2c_write(void *priv, u8 reg, u8 value)
+{
+    return i2c_smbus_write_byte_data(priv, reg, value);
+}
+
+static int chip_bus_i2c_read_block(void *priv, u8 reg, u8 *values, u8 len)
+{
+    int ret;
+
+    ret = i2c_smbus_read_i2c_block_data(priv, reg, len, values);
+    if (ret >= 0 && ret != len)
+        ret = -EIO;
+
+    return ret < 0 ? ret : 0;
+}
+
+static int chip_bus_i2c_write_block(void *priv, u8 reg, const u8 *values, u8 len)
+{
+    return i2c_smbus_write_i2c_block_data(priv, reg, len, values);
+}
+
+/* Not every adapter can do i2c block transfers. On those, blocks are
+ * moved one register at a time, which costs a transfer per register
+ * and is no longer atomic: a frame commit can show OLATA before OLATB.
+ */
+static int chip_bus_i2c_read_bytes(void *priv, u8 reg, u8 *values, u8 len)
+{
+    int i, ret;
+
+    for (i = 0; i < len; i++)
+    {
+        ret = i2c_smbus_read_byte_data(priv, reg + i);
+        if (ret < 0)
+            return ret;
+        values[i] = ret;
+    }
+
+    return 0;
+}
+
+static int chip_bus_i2c_write_bytes(void *priv, u8 reg, const u8 *values, u8 len)
+{
+    int i, ret;
+
+    for (i = 0; i < len; i++)
+    {
+        ret = i2c_smbus_write_byte_data(priv, reg + i, values[i]);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/* Each transfer takes 9 bit times per byte (8 data bits and the ACK),
+ * plus one per START and one for the STOP condition. A write is
+ * START, address, register, data and STOP. A read adds a repeated
+ * START and the address once more before the data.
+ */
+#define CHIP_BUS_HZ_DEFAULT     100000
+
+static u32 chip_bus_i2c_wire_ns(unsigned int hz, bool read, unsigned int len)
+{
+    u64 bits;
+
+    if (read)
+        bits = 9 * (3 + len) + 2 + 1;
+    else
+        bits = 9 * (2 + len) + 1 + 1;
+
+    return div_u64(bits * NSEC_PER_SEC, hz);
+}
+
+static u32 chip_bus_i2c_bytes_wire_ns(unsigned int hz, bool read,
+    unsigned int len)
+{
+    return len * chip_bus_i2c_wire_ns(hz, read, 1);
+}
+
+/* Use the adapter's clock-frequency if the platform tells us,
+ * otherwise assume standard mode.
+ */
+static unsigned int chip_adapter_hz(struct i2c_adapter *adapter)
+{
+    u32 hz;
+
+    if (adapter->dev.parent &&
+        of_property_read_u32(adapter->dev.parent->of_node,
+            "clock-frequency", &hz) == 0 && hz)
+        return hz;
+
+    return CHIP_BUS_HZ_DEFAULT;
+}
+
+static const struct chip_bus_ops chip_bus_i2c_ops = {
+    .name           = "i2c",
+    .read           = chip_bus_i2c_read,
+    .write          = chip_bus_i2c_write,
+    .read_block     = chip_bus_i2c_read_block,
+    .write_block    = chip_bus_i2c_write_block,
+    .wire_ns        = chip_bus_i2c_wire_ns,
+};
+
+static const struct chip_bus_ops chip_bus_i2c_bytes_ops = {
+    .name           = "i2c",
+    .read           = chip_bus_i2c_read,
+    .write          = chip_bus_i2c_write,
+    .read_block     = chip_bus_i2c_read_bytes,
+    .write_block    = chip_bus_i2c_write_bytes,
+    .wire_ns        = chip_bus_i2c_bytes_wire_ns,
+};
+
+static int chip_i2c_probe(struct i2c_client *client,
+    const struct i2c_device_id *id)
+{
+    struct chip_bus bus = {
+        .ops        = &chip_bus_i2c_ops,
+        .priv       = client,
+        .adapter    = client->adapter,
+        .adapter_id = i2c_adapter_id(client->adapter),
+        .hz         = chip_adapter_hz(client->adapter),
+        .irq        = client->irq,
+        .bustype    = BUS_I2C,
+    };
+
+    printk("chip_i2c: %s\n", __FUNCTION__);
+
+    /* Devices declared by the platform never went through detect */
+    if (!i2c_check_functionality(client->adapter,
+            I2C_FUNC_SMBUS_BYTE_DATA))
+        return -ENODEV;
+
+    if (!i2c_check_functionality(client->adapter,
+            I2C_FUNC_SMBUS_I2C_BLOCK))
+    {
+        dev_info(&client->dev,
+            "No i2c block transfers, moving blocks bytewise\n");
+        bus.ops = &chip_bus_i2c_bytes_ops;
+    }
+
+    return chip_core_probe(&client->dev, &bus);
+}
+
+static int chip_i2c_remove(struct i2c_client * client)
+{
+    return chip_core_remove(&client->dev);
+}
+
+/* This callback function is called by the kernel
+ * to detect the chip at a given device address.
+ * However since we know that our device is currently
+ * hardwired to 0x21, there is really nothing to detect.
+ * We simply return -ENODEV if the address is not 0x21.
+ */
+static int chip_i2c_detect(struct i2c_client * client,
+    struct i2c_board_info * info)
+{
+    struct i2c_adapter *adapter = client->adapter;
+    int address = client->addr;
+    const char * name = NULL;
+
+    printk("chip_i2c: %s!\n", __FUNCTION__);
+
+    if (!i2c_check_functionality(adapter, I2C_FUNC_SMBUS_BYTE_DATA))
+        return -ENODEV;
+
+    // Since our address is hardwired to 0x21
+    // we update the name of the driver. This must
+    // match the name of the chip_driver struct below
+    // in order for this driver to be loaded.
+    if (address == 0x21)
+    {
+        name = "chip_i2c";
+        dev_info(&adapter->dev,
+            "Chip device found at 0x%02x\n", address);
+    }else
+        return -ENODEV;
+
+    /* Upon successful detection, we coup the name of the
+     * driver to the info struct.
+     **/
+    strlcpy(info->type, name, I2C_NAME_SIZE);
+    return 0;
+}
+
+
+/* This is the main driver description table. It lists
+ * the device types, and the callback functions for this
+ * device driver
+ **/
+static struct i2c_driver chip_driver = {
+    .class      = I2C_CLASS_HWMON,
+    .driver = {
+            .name = "chip_i2c",
+    },
+    .probe          = chip_i2c_probe,
+    .remove         = chip_i2c_remove,
+    .id_table       = chip_i2c_id,
+    .detect     	= chip_i2c_detect,
+    .address_list   = normal_i2c,
+};
+
+int chip_bus_i2c_init(void)
+{
+    return i2c_add_driver(&chip_driver);
+}
+
+void chip_bus_i2c_exit(void)
+{
+    i2c_del_driver(&chip_driver);
+}
@@ -0,0 +1,153 @@
+/*
+ * Chip I2C Driver - SPI transport
+ *
+ * Copyright (C) 2014 Vergil Cola (vpcola@gmail.com)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * The MCP23S17 is the SPI flavour of the MCP23017, with the same
+ * registers. Every transfer starts with the opcode (0x40, the read
+ * bit and the hardware address, which is 0 as long as IOCON.HAEN is
+ * clear) followed by the register address. The chip increments the
+ * address by itself, so block transfers simply keep clocking.
+ *
+ * There is nothing to detect on SPI, the chip is declared as a
+ * "chip_spi" device by the board or the device tree.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/spi/spi.h>
+#include <linux/input.h>
+#include <linux/math64.h>
+#include <linux/time.h>
+
+#include "chip_core.h"
+
+#define CHIP_SPI_OPCODE         0x40
+#define CHIP_SPI_READ           0x01
+#define CHIP_SPI_MAX_HZ         10000000    /* MCP23S17 limit */
+#define CHIP_SPI_MAX_BLOCK      16
+
+/* The register accessors. spi_write_then_read() copies through its
+ * own DMA safe buffer, so our buffers may live on the stack.
+ */
+static int chip_bus_spi_read_block(void *priv, u8 reg, u8 *values, u8 len)
+{
+    u8 cmd[2] = { CHIP_SPI_OPCODE | CHIP_SPI_READ, reg };
+
+    return spi_write_then_read(priv, cmd, sizeof(cmd), values, len);
+}
+
+static int chip_bus_spi_write_block(void *priv, u8 reg, const u8 *values, u8 len)
+{
+    u8 buf[2 + CHIP_SPI_MAX_BLOCK];
+
+    if (len > CHIP_SPI_MAX_BLOCK)
+        return -EINVAL;
+
+    buf[0] = CHIP_SPI_OPCODE;
+    buf[1] = reg;
+    memcpy(&buf[2], values, len);
+
+    return spi_write_then_read(priv, buf, 2 + len, NULL, 0);
+}
+
+static int chip_bus_spi_read(void *priv, u8 reg)
+{
+    u8 value;
+    int ret;
+
+    ret = chip_bus_spi_read_block(priv, reg, &value, 1);
+    if (ret < 0)
+        return ret;
+
+    return value;
+}
+
+static int chip_bus_spi_write(void *priv, u8 reg, u8 value)
+{
+    return chip_bus_spi_write_block(priv, reg, &value, 1);
+}
+
+/* SPI has no acknowledge or start conditions, a transfer is the
+ * opcode, the register and the data, 8 clocks each.
+ */
+static u32 chip_bus_spi_wire_ns(unsigned int hz, bool read, unsigned int len)
+{
+    u64 bits = 8 * (2 + len);
+
+    return div_u64(bits * NSEC_PER_SEC, hz);
+}
+
+static const struct chip_bus_ops chip_bus_spi_ops = {
+    .name           = "spi",
+    .read           = chip_bus_spi_read,
+    .write          = chip_bus_spi_write,
+    .read_block     = chip_bus_spi_read_block,
+    .write_block    = chip_bus_spi_write_block,
+    .wire_ns        = chip_bus_spi_wire_ns,
+};
+
+static int chip_spi_probe(struct spi_device *spi)
+{
+    struct chip_bus bus;
+    int ret;
+
+    printk("chip_i2c: %s\n", __FUNCTION__);
+
+    /* The chip does mode 0 (or 3), 8 bit words. Only the clock
+     * bits are ours, keep the flags the platform set (CS_HIGH...).
+     */
+    spi->mode = (spi->mode & ~SPI_MODE_3) | SPI_MODE_0;
+    spi->bits_per_word = 8;
+    if (!spi->max_speed_hz || spi->max_speed_hz > CHIP_SPI_MAX_HZ)
+        spi->max_speed_hz = CHIP_SPI_MAX_HZ;
+    ret = spi_setup(spi);
+    if (ret)
+        return ret;
+
+    bus.ops = &chip_bus_spi_ops;
+    bus.priv = spi;
+    bus.adapter = spi->master;
+    bus.adapter_id = spi->master->bus_num;
+    bus.hz = spi->max_speed_hz;
+    bus.irq = spi->irq;
+    bus.bustype = BUS_SPI;
+
+    return chip_core_probe(&spi->dev, &bus);
+}
+
+static int chip_spi_remove(struct spi_device *spi)
+{
+    return chip_core_remove(&spi->dev);
+}
+
+static const struct spi_device_id chip_spi_id[] = {
+    { "chip_spi", 0 },
+    {}
+};
+
+MODULE_DEVICE_TABLE(spi, chip_spi_id);
+
+static struct spi_driver chip_spi_driver = {
+    .driver = {
+            .name = "chip_spi",
+            .owner = THIS_MODULE,
+    },
+    .probe          = chip_spi_probe,
+    .remove         = chip_spi_remove,
+    .id_table       = chip_spi_id,
+};
+
+int chip_bus_spi_init(void)
+{
+    return spi_register_driver(&chip_spi_driver);
+}
+
+void chip_bus_spi_exit(void)
+{
+    spi_unregister_driver(&chip_spi_driver);
+}
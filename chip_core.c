@@ -0,0 +1,4920 @@
+/*
+ * Chip I2C Driver
+ *
+ * Copyright (C) 2014 Vergil Cola (vpcola@gmail.com)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * This driver shows how to create a minimal i2c driver for Raspberry Pi.
+ * The arbitrary i2c hardware sits on 0x21 using the MCP23017 chip. 
+ *
+ * PORTA is connected to output leds while PORTB of MCP23017 is connected
+ * to dip switches.
+ *
+ * This is the bus agnostic core of the driver. The chip is reached
+ * through one of the transports in chip_bus_i2c.c (MCP23017) and
+ * chip_bus_spi.c (MCP23S17), see chip_core.h.
+ *
+ */
+
+#define DEBUG 1
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/rwsem.h>
+#include <linux/err.h>
+#include <linux/sysfs.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/interrupt.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/kref.h>
+#include <linux/vmalloc.h>
+#include <linux/eventfd.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/rmap.h>
+#include <linux/poll.h>
+#include <linux/percpu.h>
+#include <linux/perf_event.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <net/genetlink.h>
+#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/leds.h>
+#include <linux/input.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#include <linux/uaccess.h>
+
+#include "chip_i2c.h"
+#include "chip_core.h"
+
+
+#define CHIP_I2C_DEVICE_NAME    "chip_i2c"
+
+/* Bus occupancy is accounted in one second buckets, which gives us
+ * the estimated duty cycle of the bus over the last 1, 10 and 60
+ * seconds.
+ */
+#define CHIP_OCC_BUCKETS    60
+
+struct chip_occupancy {
+    spinlock_t lock;
+    unsigned long last;             /* Second of the newest bucket */
+    u64 busy_ns[CHIP_OCC_BUCKETS];  /* Estimated wire time per second */
+};
+
+/* Occupancy of an adapter (or SPI controller), shared by all our
+ * chips on it.
+ */
+struct chip_adapter_stats {
+    struct list_head list;
+    void * adapter;
+    int refs;
+    struct chip_occupancy occ;
+};
+
+/* Lock contention profiling, reported through debugfs. For each lock
+ * we keep the number of acquisitions, how many of them found the lock
+ * taken, the wait and hold times and the tasks that waited the most.
+ * held_since and last_wait_ns belong to the lock owner, the rest is
+ * protected by the stats spinlock.
+ */
+#define CHIP_LOCK_TOP_WAITERS   8
+
+struct chip_lock_waiter {
+    pid_t pid;
+    char comm[TASK_COMM_LEN];
+    u64 wait_ns;
+    u64 count;
+};
+
+struct chip_lock_stats {
+    spinlock_t lock;
+    u64 acquired;
+    u64 contended;
+    u64 timeouts;
+    u64 wait_total_ns;
+    u64 wait_max_ns;
+    u64 hold_total_ns;
+    u64 hold_max_ns;
+    struct chip_lock_waiter top[CHIP_LOCK_TOP_WAITERS];
+    ktime_t held_since;
+    u64 last_wait_ns;
+};
+
+/* Slow transfer monitor. Transfers taking longer than the threshold
+ * of their type are recorded in a small ring, readable through
+ * debugfs (slow_events), together with the context they ran in.
+ */
+#define CHIP_SLOW_EVENTS        64
+#define CHIP_SLOW_READ_US       10000
+#define CHIP_SLOW_WRITE_US      10000
+
+struct chip_slow_event {
+    u64 timestamp_ns;       /* ktime at the start of the transfer */
+    u64 duration_ns;
+    u64 lock_wait_ns;       /* Wait for update_lock before it */
+    pid_t pid;
+    char comm[TASK_COMM_LEN];
+    int adapter;
+    int result;
+    u8 reg;
+    bool write;
+};
+
+struct chip_slow_log {
+    spinlock_t lock;
+    u32 read_us;            /* Thresholds, 0 = don't record */
+    u32 write_us;
+    unsigned int head;      /* Next slot to use */
+    unsigned int count;
+    u64 total;              /* Slow transfers seen overall */
+    struct chip_slow_event events[CHIP_SLOW_EVENTS];
+};
+
+/* Switch events multicast over generic netlink are batched, up to
+ * CHIP_GENL_BATCH events or event_batch_ms per message.
+ */
+#define CHIP_GENL_BATCH         32
+#define CHIP_GENL_BATCH_MS      10
+
+struct chip_genl_event {
+    u64 timestamp_ns;
+    u8 old;
+    u8 value;
+};
+
+/* Arbitration policies between the open files writing the leds */
+enum chip_led_policy {
+    CHIP_LED_LAST_WRITER,   /* Every write goes straight to the leds */
+    CHIP_LED_OWNER,         /* Files only change the leds they claimed */
+    CHIP_LED_FAIR,          /* Writes are interleaved between files */
+};
+
+#define CHIP_FB_DELAY_MS        20  /* Default led framebuffer flush delay */
+
+#define CHIP_LED_FLUSH_MS       10  /* Default led class flush interval */
+
+#define CHIP_EDGE_GATE_MS       1000 /* Default frequency gate time */
+
+#define CHIP_CAPTURE_ENTRIES    4096 /* Input capture ring size */
+
+#define CHIP_STORM_RATE         500  /* Default storm limit, irqs/s */
+#define CHIP_STORM_WINDOW_MS    100  /* Interrupts are counted over this */
+#define CHIP_STORM_SAMPLE_MS    50   /* Sampling period during a storm */
+#define CHIP_STORM_QUIET_MS     1000 /* Quiet time that ends a storm */
+#define CHIP_HOLD_SAMPLE_MS     50   /* Sampling period of held switches */
+
+#define CHIP_FILE_EVENTS        64  /* Queued switch events per file */
+#define CHIP_FAIR_QUEUE         64  /* Queued led writes per file */
+
+struct chip_ring;
+struct chip_data;
+
+/* Each PORTA bit is also a led class device */
+struct chip_led {
+    struct led_classdev cdev;
+    struct chip_data * data;
+    int bit;
+    char name[32];
+};
+
+/* Every open of /dev/chip_i2c_leds gets its own context. The open
+ * files are kept on the chip_files list (under chip_i2c_mutex) so
+ * that switch events can be delivered to each of them.
+ */
+struct chip_file {
+    struct list_head list;
+    struct chip_data * data;
+    struct chip_ring * ring;
+    bool reader;                    /* Opened for reading events */
+    wait_queue_head_t wait;         /* Readers and fair writers wait */
+    spinlock_t lock;                /* Protects the queues below */
+    struct chip_i2c_event events[CHIP_FILE_EVENTS];
+    unsigned int ev_head;
+    unsigned int ev_count;
+    u8 fair[CHIP_FAIR_QUEUE];       /* Pending writes, fair policy */
+    unsigned int fair_head;
+    unsigned int fair_count;
+    u8 owned;                       /* Claimed leds, owner policy */
+    u8 sub_mask;                    /* Switches the reader cares for */
+    u8 sub_edges;                   /* CHIP_I2C_SUB_RISING/FALLING */
+    struct chip_i2c_file_stats stats;
+};
+
+/* Each client has that uses the driver stores data in this structure.
+ * Open files hold a reference, so it outlives chip_core_remove() until
+ * the last of them is closed. Once dead is set (under update_lock) the
+ * bus accessors fail with -ENODEV.
+ */
+struct chip_data {
+	struct mutex update_lock;
+    struct kref kref;
+    bool dead;                      /* The chip has been removed */
+	unsigned long led_last_updated;	/* In jiffies */
+    unsigned long switch_last_read; /* In jiffies */
+    struct device * dev;
+    struct chip_bus bus;            /* How we reach the chip */
+    seqlock_t switch_seq;           /* Protects switch_value/last_read */
+    int switch_value;               /* Last PORTB read, -1 if none */
+    unsigned int switch_max_age_ms; /* Switch read cache TTL, 0 = off */
+    unsigned int read_deadline_ms;  /* Max bus wait for sysfs reads */
+    u8 led_value;                   /* Last value written to PORTA */
+    u8 olatb_value;                 /* ... and to OLATB */
+    struct delayed_work sample_work;
+    unsigned int sample_ms;         /* Switch sampling period, 0 = off */
+    struct chip_i2c_reflex reflex;  /* Switch to led map, update_lock */
+    struct chip_i2c_irq_mode irq_mode;  /* Per switch interrupt mode */
+    u8 irq_held;                    /* Compare switches away from */
+                                    /* their defval, sampled */
+    struct delayed_work hold_work;
+    unsigned int storm_rate;        /* Storm limit per switch, 0 = off */
+    unsigned int storm_counts[8];   /* Interrupts in the window */
+    unsigned long storm_window;     /* Window start, in jiffies */
+    unsigned long storm_active;     /* Last change while storming */
+    u8 storm_bits;                  /* Switches being sampled */
+    struct delayed_work storm_work;
+    spinlock_t submit_lock;         /* Protects the two below */
+    struct list_head submit_list;   /* Queued chip_i2c_submit() requests */
+    bool submit_dead;               /* The client is going away */
+    struct work_struct submit_work;
+    unsigned int bus_hz;            /* Assumed bus clock frequency */
+    u32 wire_read_ns;               /* Estimated wire time of a read */
+    u32 wire_write_ns;              /* ... and of a write */
+    struct chip_occupancy occ;
+    struct chip_adapter_stats * adapter_stats;
+    struct chip_lock_stats lock_stats;  /* Of update_lock */
+    struct chip_slow_log slow;
+    spinlock_t genl_lock;           /* Protects the pending events */
+    struct chip_genl_event genl_events[CHIP_GENL_BATCH];
+    unsigned int genl_count;
+    unsigned int genl_dropped;      /* Lost to a full batch */
+    bool genl_dead;                 /* The client is going away */
+    unsigned int event_batch_ms;
+    struct delayed_work genl_work;
+    unsigned int stats_interval_ms; /* Stats multicast period, 0 = off */
+    struct delayed_work stats_work;
+    unsigned int led_policy;        /* enum chip_led_policy */
+    u8 led_owned;                   /* Leds claimed by open files */
+    u8 led_owner_bits;              /* The owners' values of those */
+    struct page * fb_page;          /* mmap()able led framebuffer */
+    unsigned int fb_delay_ms;       /* Min time between fb flushes */
+    struct delayed_work fb_work;
+    struct mutex frame_lock;        /* Serializes frame commits */
+    u8 frame_back[2];               /* Back buffer, OLATA and OLATB */
+    bool frame_open;                /* Back buffer drawn since commit */
+    unsigned int frame_rate;        /* Commit pacing in Hz, 0 = off */
+    ktime_t frame_last;             /* When the last frame went out */
+    u64 frames;                     /* Frames committed */
+    u64 frames_missed;              /* ... too late for their slot */
+    struct mutex bam_lock;          /* Starts and stops the BAM thread */
+    struct task_struct * bam_thread;
+    unsigned int bam_rate;          /* BAM periods per second, 0 = off */
+    u8 brightness[8];               /* Per led brightness, update_lock */
+    u8 bam_planes[8];               /* Led value of each bit plane */
+    u32 bam_overruns;               /* Planes the bus couldn't keep up with */
+    struct chip_led leds[8];
+    spinlock_t leds_lock;           /* Protects the pending changes */
+    u8 leds_pending[8];             /* Brightness set by the led class */
+    u8 leds_dirty;                  /* Leds with a pending change */
+    unsigned int led_flush_ms;      /* Led class coalescing interval */
+    struct delayed_work leds_work;
+    struct input_dev * input;       /* The switches, for evdev */
+    unsigned short keymap[8];       /* Key code of each switch */
+    struct iio_dev * iio;           /* Triggered capture of the ports */
+    bool edge_valid;                /* edge_last holds a real value */
+    u8 edge_last;                   /* PORTB after the last interrupt */
+    u64 edge_rising[8];             /* Edge counts per switch, */
+    u64 edge_falling[8];            /* update_lock */
+    u64 edge_gate_start[8];         /* Rising edges at gate start */
+    u32 edge_freq_mhz[8];           /* Over the last gate, in mHz */
+    unsigned int edge_gate_ms;      /* Frequency gate time, 0 = off */
+    struct delayed_work edge_work;
+    ktime_t irq_time;               /* When the interrupt fired */
+    bool capture;                   /* Input capture is on */
+    void * capture_mem;             /* vmalloc_user(), mmap()ed */
+    struct chip_i2c_capture_hdr * capture_hdr;
+    struct chip_i2c_capture * captures;
+    u32 capture_head;               /* Our copy, the header is user */
+                                    /* writable */
+    struct work_struct fair_work;
+    struct dentry * debugfs;
+    /* TODO: additional client driver data here */
+};
+
+/**
+ * The following variables are used by the exposed 
+ * fileops (character device driver) functions to
+ * allow our driver to be opened by normal file operations
+ * - open/close/read/write from user space.
+ */
+static struct class * chip_i2c_class = NULL;
+static struct device * chip_i2c_device = NULL;
+static int chip_i2c_major;
+
+/* Define the global chip structure used by this
+ * driver. We use this for the file operations (chardev)
+ * functions to access the chip.
+ */
+static struct chip_data * chip_i2c_chip = NULL;
+
+/* The adapters our clients sit on, see chip_adapter_get() */
+static LIST_HEAD(chip_adapters);
+static DEFINE_MUTEX(chip_adapters_lock);
+
+/* Any number of processes can open our driver at /dev, each
+* gets a struct chip_file on this list. The mutex protects the
+* list, it nests inside a client's update_lock.
+*/
+static LIST_HEAD(chip_files);
+static DEFINE_MUTEX(chip_i2c_mutex);
+static struct chip_lock_stats chip_i2c_mutex_stats = {
+    .lock = __SPIN_LOCK_UNLOCKED(chip_i2c_mutex_stats.lock),
+};
+
+/* Our debugfs directory (chip_i2c), one subdirectory per client */
+static struct dentry * chip_debugfs_root = NULL;
+
+/* The switch handler attached by another module (if any), see
+ * chip_i2c_register_switch_handler(). The rwsem lets the change path
+ * call into the handler while unregistering waits for it to finish.
+ */
+static struct chip_i2c_switch_handler * chip_switch_handler = NULL;
+static DECLARE_RWSEM(chip_handler_rwsem);
+
+/* We define the MCP23017 registers. We only need to set the
+ * direction registers for input and output
+ **/
+#define REG_CHIP_DIR_PORTA	0x00
+#define REG_CHIP_DIR_PORTB  0x01
+
+/* Interrupt on change registers for PORTB (IOCON.BANK = 0) */
+#define REG_CHIP_GPINTENB   0x05
+#define REG_CHIP_DEFVALB    0x07
+#define REG_CHIP_INTCONB    0x09
+#define REG_CHIP_INTFB      0x0F
+#define REG_CHIP_INTCAPB    0x11
+
+#define REG_CHIP_PORTA_LIN  0x12
+#define REG_CHIP_PORTB_LIN  0x13
+#define REG_CHIP_PORTA_LOUT	0x14
+#define REG_CHIP_PORTB_LOUT 0x15
+
+
+/* Driver wide event counters, exported to perf through the chip_i2c
+ * PMU (see chip_pmu_init() below). They are kept per cpu so that a
+ * perf event can be counted per task: whatever is counted on a cpu
+ * while the task runs is charged to it. That is only approximate,
+ * much of the bus traffic is done by our kthreads and workqueues on
+ * behalf of other tasks, and is charged to those threads.
+ */
+enum chip_counter {
+    CHIP_CNT_BUS_READS,
+    CHIP_CNT_BUS_WRITES,
+    CHIP_CNT_BUS_BYTES,         /* register and data bytes */
+    CHIP_CNT_LOCK_CONTENDED,    /* update_lock was already taken */
+    CHIP_CNT_COALESCED_WRITES,  /* led writes folded into another */
+    CHIP_CNT_BUS_ERRORS,
+    CHIP_CNT_MAX
+};
+
+static DEFINE_PER_CPU(u64 [CHIP_CNT_MAX], chip_counters);
+
+static inline void chip_count(enum chip_counter counter, u64 n)
+{
+    this_cpu_add(chip_counters[counter], n);
+}
+
+/* Sum of a counter over all cpus */
+static u64 chip_counter_sum(enum chip_counter counter)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += per_cpu(chip_counters[counter], cpu);
+
+    return sum;
+}
+
+/* Bus utilization estimation. We can't time the wire directly, so
+ * each transfer is charged the time it takes at the bus clock, as
+ * estimated by the transport's wire_ns().
+ */
+static void chip_set_bus_hz(struct chip_data *data, unsigned int hz)
+{
+    data->bus_hz = hz;
+    data->wire_write_ns = data->bus.ops->wire_ns(hz, false, 1);
+    data->wire_read_ns = data->bus.ops->wire_ns(hz, true, 1);
+}
+
+/* Drop the buckets that have aged out, caller holds occ->lock */
+static void chip_occupancy_advance(struct chip_occupancy *occ,
+    unsigned long now)
+{
+    if (now - occ->last >= CHIP_OCC_BUCKETS)
+    {
+        memset(occ->busy_ns, 0, sizeof(occ->busy_ns));
+        occ->last = now;
+        return;
+    }
+
+    while (occ->last != now)
+    {
+        occ->last++;
+        occ->busy_ns[occ->last % CHIP_OCC_BUCKETS] = 0;
+    }
+}
+
+static void chip_occupancy_add(struct chip_occupancy *occ, u32 ns)
+{
+    unsigned long now = jiffies / HZ;
+    unsigned long flags;
+
+    spin_lock_irqsave(&occ->lock, flags);
+    chip_occupancy_advance(occ, now);
+    occ->busy_ns[now % CHIP_OCC_BUCKETS] += ns;
+    spin_unlock_irqrestore(&occ->lock, flags);
+}
+
+/* Occupancy over the last 'seconds' complete seconds, in hundredths
+ * of a percent.
+ */
+static unsigned int chip_occupancy_get(struct chip_occupancy *occ,
+    unsigned int seconds)
+{
+    unsigned long now = jiffies / HZ;
+    unsigned long flags;
+    u64 busy = 0;
+    unsigned int i;
+
+    spin_lock_irqsave(&occ->lock, flags);
+    chip_occupancy_advance(occ, now);
+    for (i = 1; i <= seconds; i++)
+        busy += occ->busy_ns[(now - i) % CHIP_OCC_BUCKETS];
+    spin_unlock_irqrestore(&occ->lock, flags);
+
+    return div64_u64(busy * 10000, (u64) seconds * NSEC_PER_SEC);
+}
+
+static ssize_t chip_occupancy_show(struct chip_occupancy *occ, char *buf)
+{
+    unsigned int o1 = chip_occupancy_get(occ, 1);
+    unsigned int o10 = chip_occupancy_get(occ, 10);
+    unsigned int o60 = chip_occupancy_get(occ, 60);
+
+    return sprintf(buf, "%u.%02u %u.%02u %u.%02u\n",
+        o1 / 100, o1 % 100, o10 / 100, o10 % 100, o60 / 100, o60 % 100);
+}
+
+/* Find (or create) the shared stats of an adapter */
+static struct chip_adapter_stats * chip_adapter_get(void *adapter)
+{
+    struct chip_adapter_stats *stats;
+
+    mutex_lock(&chip_adapters_lock);
+    list_for_each_entry(stats, &chip_adapters, list)
+        if (stats->adapter == adapter)
+            goto found;
+
+    stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+    if (!stats)
+        goto out;
+    stats->adapter = adapter;
+    spin_lock_init(&stats->occ.lock);
+    list_add(&stats->list, &chip_adapters);
+found:
+    stats->refs++;
+out:
+    mutex_unlock(&chip_adapters_lock);
+    return stats;
+}
+
+static void chip_adapter_put(struct chip_adapter_stats *stats)
+{
+    mutex_lock(&chip_adapters_lock);
+    if (--stats->refs == 0)
+    {
+        list_del(&stats->list);
+        kfree(stats);
+    }
+    mutex_unlock(&chip_adapters_lock);
+}
+
+static void chip_bus_account(struct chip_data *data, u32 ns)
+{
+    chip_occupancy_add(&data->occ, ns);
+    chip_occupancy_add(&data->adapter_stats->occ, ns);
+}
+
+/* Account for a task that had to wait wait_ns for a lock. We keep
+ * the CHIP_LOCK_TOP_WAITERS tasks with the longest total wait, a new
+ * task replaces the one with the least wait once the table is full.
+ * Caller holds stats->lock.
+ */
+static void chip_lock_top_waiter(struct chip_lock_stats *stats, u64 wait_ns)
+{
+    struct chip_lock_waiter *waiter, *least = &stats->top[0];
+    pid_t pid = task_pid_nr(current);
+    int i;
+
+    for (i = 0; i < CHIP_LOCK_TOP_WAITERS; i++)
+    {
+        waiter = &stats->top[i];
+        if (waiter->count && waiter->pid == pid)
+            goto found;
+        if (waiter->wait_ns < least->wait_ns)
+            least = waiter;
+    }
+
+    waiter = least;
+    if (waiter->count && waiter->wait_ns >= wait_ns)
+        return;
+
+    waiter->pid = pid;
+    get_task_comm(waiter->comm, current);
+    waiter->wait_ns = 0;
+    waiter->count = 0;
+found:
+    waiter->wait_ns += wait_ns;
+    waiter->count++;
+}
+
+/* Called by the new owner right after taking a lock */
+static void chip_lock_acquired(struct chip_lock_stats *stats,
+    bool contended, ktime_t wait_start)
+{
+    ktime_t now = ktime_get();
+    u64 wait_ns = 0;
+
+    if (contended)
+        wait_ns = ktime_to_ns(ktime_sub(now, wait_start));
+
+    spin_lock(&stats->lock);
+    stats->acquired++;
+    if (contended)
+    {
+        stats->contended++;
+        stats->wait_total_ns += wait_ns;
+        if (wait_ns > stats->wait_max_ns)
+            stats->wait_max_ns = wait_ns;
+        chip_lock_top_waiter(stats, wait_ns);
+    }
+    spin_unlock(&stats->lock);
+
+    stats->held_since = now;
+    stats->last_wait_ns = wait_ns;
+}
+
+/* Called by the owner right before releasing a lock */
+static void chip_lock_released(struct chip_lock_stats *stats)
+{
+    u64 hold_ns = ktime_to_ns(ktime_sub(ktime_get(), stats->held_since));
+
+    spin_lock(&stats->lock);
+    stats->hold_total_ns += hold_ns;
+    if (hold_ns > stats->hold_max_ns)
+        stats->hold_max_ns = hold_ns;
+    spin_unlock(&stats->lock);
+}
+
+/* Take a mutex and account for it in stats. Returns true if the
+ * mutex was contended.
+ */
+static bool chip_mutex_lock(struct mutex *lock, struct chip_lock_stats *stats)
+{
+    ktime_t start;
+
+    if (mutex_trylock(lock))
+    {
+        chip_lock_acquired(stats, false, ktime_set(0, 0));
+        return false;
+    }
+
+    start = ktime_get();
+    mutex_lock(lock);
+    chip_lock_acquired(stats, true, start);
+    return true;
+}
+
+static void chip_mutex_unlock(struct mutex *lock, struct chip_lock_stats *stats)
+{
+    chip_lock_released(stats);
+    mutex_unlock(lock);
+}
+
+/* Every user of the bus takes the client's update_lock through
+ * these, so that contention can be accounted for.
+ */
+static void chip_lock(struct chip_data *data)
+{
+    if (chip_mutex_lock(&data->update_lock, &data->lock_stats))
+        chip_count(CHIP_CNT_LOCK_CONTENDED, 1);
+}
+
+static void chip_unlock(struct chip_data *data)
+{
+    chip_mutex_unlock(&data->update_lock, &data->lock_stats);
+}
+
+static void chip_files_lock(void)
+{
+    chip_mutex_lock(&chip_i2c_mutex, &chip_i2c_mutex_stats);
+}
+
+static void chip_files_unlock(void)
+{
+    chip_mutex_unlock(&chip_i2c_mutex, &chip_i2c_mutex_stats);
+}
+
+/* Record a transfer that took longer than its threshold. Called
+ * from the raw accessors, so update_lock is held and the lock stats
+ * still hold our own wait for it.
+ */
+static void chip_slow_check(struct chip_data *data, bool write, u8 reg,
+    int result, ktime_t start)
+{
+    struct chip_slow_log *slow = &data->slow;
+    struct chip_slow_event *event;
+    u64 duration_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    u32 limit_us = write ? ACCESS_ONCE(slow->write_us) :
+        ACCESS_ONCE(slow->read_us);
+
+    if (limit_us == 0 || duration_ns <= (u64) limit_us * NSEC_PER_USEC)
+        return;
+
+    spin_lock(&slow->lock);
+    event = &slow->events[slow->head];
+    event->timestamp_ns = ktime_to_ns(start);
+    event->duration_ns = duration_ns;
+    event->lock_wait_ns = data->lock_stats.last_wait_ns;
+    event->pid = task_pid_nr(current);
+    get_task_comm(event->comm, current);
+    event->adapter = data->bus.adapter_id;
+    event->result = result;
+    event->reg = reg;
+    event->write = write;
+    slow->head = (slow->head + 1) % CHIP_SLOW_EVENTS;
+    if (slow->count < CHIP_SLOW_EVENTS)
+        slow->count++;
+    slow->total++;
+    spin_unlock(&slow->lock);
+}
+
+/* The led framebuffer page (see chip_fb_work()) shows the led latch,
+ * whoever wrote it. Called with update_lock held.
+ */
+static void chip_fb_show(struct chip_data *data, u8 value)
+{
+    if (data->fb_page)
+        ACCESS_ONCE(*(u8 *)page_address(data->fb_page)) = value;
+}
+
+/* The raw bus accessors. All transfers to our chip go through
+ * these two, the caller must hold the client's update_lock.
+ * Writes to PORTA are remembered in led_value so that other
+ * parts of the driver can change some of the leds without
+ * reading them back from the chip. After the chip is removed
+ * they fail without touching the bus.
+ */
+static int __chip_read_value(struct chip_data *data, u8 reg)
+{
+    ktime_t start = ktime_get();
+    int val;
+
+    if (data->dead)
+        return -ENODEV;
+
+    val = data->bus.ops->read(data->bus.priv, reg);
+    chip_slow_check(data, false, reg, val, start);
+    chip_bus_account(data, data->wire_read_ns);
+    chip_count(CHIP_CNT_BUS_READS, 1);
+    chip_count(CHIP_CNT_BUS_BYTES, 2);
+    if (val < 0)
+        chip_count(CHIP_CNT_BUS_ERRORS, 1);
+
+    return val;
+}
+
+static int __chip_write_value(struct chip_data *data, u8 reg, u8 value)
+{
+    ktime_t start = ktime_get();
+    int ret;
+
+    if (data->dead)
+        return -ENODEV;
+
+    ret = data->bus.ops->write(data->bus.priv, reg, value);
+    chip_slow_check(data, true, reg, ret, start);
+    chip_bus_account(data, data->wire_write_ns);
+    chip_count(CHIP_CNT_BUS_WRITES, 1);
+    chip_count(CHIP_CNT_BUS_BYTES, 2);
+    if (ret < 0)
+        chip_count(CHIP_CNT_BUS_ERRORS, 1);
+    else if (reg == REG_CHIP_PORTA_LOUT)
+    {
+        data->led_value = value;
+        data->led_last_updated = jiffies;
+        chip_fb_show(data, value);
+    }
+    else if (reg == REG_CHIP_PORTB_LOUT)
+        data->olatb_value = value;
+
+    return ret;
+}
+
+/* The last reference to a client's data is gone, the device has been
+ * removed and all files using it are closed.
+ */
+static void chip_data_release(struct kref *kref)
+{
+    struct chip_data *data = container_of(kref, struct chip_data, kref);
+
+    /* Closed files may have left work behind */
+    cancel_work_sync(&data->fair_work);
+    cancel_delayed_work_sync(&data->fb_work);
+
+    if (data->fb_page)
+    {
+        /* Mappings that are still around keep their own reference */
+        data->fb_page->mapping = NULL;
+        __free_page(data->fb_page);
+    }
+    vfree(data->capture_mem);
+    kfree(data);
+}
+
+static void chip_data_put(struct chip_data *data)
+{
+    kref_put(&data->kref, chip_data_release);
+}
+
+/* Write len consecutive registers in one transfer, the MCP23017
+ * increments the register address by itself (IOCON.SEQOP = 0).
+ */
+static int __chip_write_block(struct chip_data *data, u8 reg,
+    const u8 *values, u8 len)
+{
+    ktime_t start = ktime_get();
+    int ret;
+
+    if (data->dead)
+        return -ENODEV;
+
+    ret = data->bus.ops->write_block(data->bus.priv, reg, values, len);
+    chip_slow_check(data, true, reg, ret, start);
+    chip_bus_account(data, data->bus.ops->wire_ns(data->bus_hz, false, len));
+    chip_count(CHIP_CNT_BUS_WRITES, 1);
+    chip_count(CHIP_CNT_BUS_BYTES, 1 + len);
+    if (ret < 0)
+        chip_count(CHIP_CNT_BUS_ERRORS, 1);
+    else if (reg == REG_CHIP_PORTA_LOUT)
+    {
+        data->led_value = values[0];
+        data->led_last_updated = jiffies;
+        chip_fb_show(data, values[0]);
+        if (len > 1)
+            data->olatb_value = values[1];
+    }
+    else if (reg == REG_CHIP_PORTB_LOUT)
+        data->olatb_value = values[0];
+
+    return ret;
+}
+
+/* Read len consecutive registers in one transfer */
+static int __chip_read_block(struct chip_data *data, u8 reg,
+    u8 *values, u8 len)
+{
+    ktime_t start = ktime_get();
+    int ret;
+
+    if (data->dead)
+        return -ENODEV;
+
+    ret = data->bus.ops->read_block(data->bus.priv, reg, values, len);
+    chip_slow_check(data, false, reg, ret, start);
+    chip_bus_account(data, data->bus.ops->wire_ns(data->bus_hz, true, len));
+    chip_count(CHIP_CNT_BUS_READS, 1);
+    chip_count(CHIP_CNT_BUS_BYTES, 2 + len);
+    if (ret < 0)
+        chip_count(CHIP_CNT_BUS_ERRORS, 1);
+
+    return ret;
+}
+
+/* Input/Output functions of our driver to read/write
+ * data on the bus. The transport's read() and write() 
+ * (chip_core.h) do the low level read/write to our device.
+ * To make sure no other client is writing/reading from the 
+ * device at the same time, we use the client data's mutex 
+ * for synchronization.
+ *
+ * chip_write_value() is left for setting up the chip, everything
+ * else runs under the lock already and calls the __ versions.
+ */
+static int chip_write_value(struct chip_data *data, u8 reg, u16 value)
+{
+    int ret = 0;
+
+    chip_lock(data);
+    ret =  __chip_write_value(data, reg, value);
+    chip_unlock(data);
+
+    return ret;
+}
+
+/* Acquire the client's update_lock, but give up after timeout_ms
+ * milliseconds. A timeout of 0 waits forever, just like mutex_lock().
+ * Kernel mutexes have no timed lock, so we poll with mutex_trylock().
+ * Returns 0 with the lock held, or -ETIMEDOUT.
+ */
+static int chip_lock_timeout(struct chip_data *data, unsigned int timeout_ms)
+{
+    unsigned long deadline;
+    ktime_t start;
+
+    if (timeout_ms == 0)
+    {
+        chip_lock(data);
+        return 0;
+    }
+
+    if (mutex_trylock(&data->update_lock))
+    {
+        chip_lock_acquired(&data->lock_stats, false, ktime_set(0, 0));
+        return 0;
+    }
+    chip_count(CHIP_CNT_LOCK_CONTENDED, 1);
+
+    start = ktime_get();
+    deadline = jiffies + msecs_to_jiffies(timeout_ms);
+    while (!mutex_trylock(&data->update_lock))
+    {
+        if (time_after(jiffies, deadline))
+        {
+            spin_lock(&data->lock_stats.lock);
+            data->lock_stats.timeouts++;
+            spin_unlock(&data->lock_stats.lock);
+            return -ETIMEDOUT;
+        }
+        usleep_range(100, 200);
+    }
+    chip_lock_acquired(&data->lock_stats, true, start);
+
+    return 0;
+}
+
+/* The last PORTB value read from the bus is cached together with
+ * the time (switch_last_read) it was read. The pair is protected by
+ * a seqlock so that readers never contend with each other, only the
+ * (rare) bus reads take the write side.
+ *
+ * chip_switch_cached() returns the cached value (or -1 if we never
+ * read the switches) and its age in jiffies.
+ */
+static int chip_switch_cached(struct chip_data *data, unsigned long *age)
+{
+    unsigned int seq;
+    unsigned long stamp;
+    int val;
+
+    do {
+        seq = read_seqbegin(&data->switch_seq);
+        val = data->switch_value;
+        stamp = data->switch_last_read;
+    } while (read_seqretry(&data->switch_seq, seq));
+
+    *age = jiffies - stamp;
+    return val;
+}
+
+static void chip_switch_store(struct chip_data *data, u8 value)
+{
+    write_seqlock(&data->switch_seq);
+    data->switch_value = value;
+    data->switch_last_read = jiffies;
+    write_sequnlock(&data->switch_seq);
+}
+
+/* The reflex engine maps the switches straight onto the leds from
+ * the switch change path, without a round trip through user space.
+ * Only the led bits in reflex.mask are driven by the map, the rest
+ * keep their last written value. An attached switch handler replaces
+ * the map, whichever path runs it. Called with update_lock held.
+ */
+static void chip_reflex_run(struct chip_data *data, u8 value)
+{
+    struct chip_i2c_reflex *reflex = &data->reflex;
+    bool attached;
+    u8 out;
+
+    down_read(&chip_handler_rwsem);
+    attached = chip_switch_handler != NULL;
+    up_read(&chip_handler_rwsem);
+    if (attached)
+        return;
+
+    switch (reflex->mode)
+    {
+    case CHIP_I2C_REFLEX_COPY:
+        out = value;
+        break;
+    case CHIP_I2C_REFLEX_INVERT:
+        out = ~value;
+        break;
+    case CHIP_I2C_REFLEX_LUT:
+        out = reflex->lut[value];
+        break;
+    default:
+        return;
+    }
+
+    out = (data->led_value & ~reflex->mask) | (out & reflex->mask);
+    if (out != data->led_value)
+        __chip_write_value(data, REG_CHIP_PORTA_LOUT, out);
+    else
+        chip_count(CHIP_CNT_COALESCED_WRITES, 1);
+}
+
+/* Generic netlink. Switch events and periodic stats snapshots are
+ * multicast to the "events" group of the chip_i2c family, so any
+ * number of daemons can follow the switches off a single bus read.
+ * See chip_i2c.h for the message layout.
+ */
+static struct genl_family chip_genl_family = {
+    .id         = GENL_ID_GENERATE,
+    .name       = CHIP_I2C_GENL_NAME,
+    .version    = CHIP_I2C_GENL_VERSION,
+    .maxattr    = CHIP_I2C_A_MAX,
+};
+
+static struct genl_multicast_group chip_genl_mcgrp = {
+    .name       = CHIP_I2C_GENL_MCGRP,
+};
+
+static bool chip_genl_registered;
+
+/* Queue a switch event for the next batch, the batch is sent when it
+ * is full or event_batch_ms after its first event.
+ */
+static void chip_genl_queue_event(struct chip_data *data, u8 old, u8 value)
+{
+    struct chip_genl_event *event;
+    unsigned int count;
+
+    if (!chip_genl_registered)
+        return;
+
+    spin_lock(&data->genl_lock);
+    if (data->genl_dead)
+    {
+        /* Don't re-arm genl_work behind chip_core_remove() */
+        spin_unlock(&data->genl_lock);
+        return;
+    }
+    count = data->genl_count;
+    if (count < CHIP_GENL_BATCH)
+    {
+        event = &data->genl_events[count];
+        event->timestamp_ns = ktime_to_ns(ktime_get());
+        event->old = old;
+        event->value = value;
+        data->genl_count++;
+    }
+    else
+        data->genl_dropped++;
+    spin_unlock(&data->genl_lock);
+
+    if (count == 0)
+        schedule_delayed_work(&data->genl_work,
+            msecs_to_jiffies(ACCESS_ONCE(data->event_batch_ms)));
+    else if (count + 1 == CHIP_GENL_BATCH)
+        mod_delayed_work(system_wq, &data->genl_work, 0);
+}
+
+static void chip_genl_work(struct work_struct *work)
+{
+    struct chip_data *data = container_of(to_delayed_work(work),
+        struct chip_data, genl_work);
+    struct chip_genl_event events[CHIP_GENL_BATCH];
+    unsigned int count, dropped, i;
+    struct sk_buff *skb;
+    struct nlattr *nest;
+    void *hdr;
+
+    spin_lock(&data->genl_lock);
+    count = data->genl_count;
+    dropped = data->genl_dropped;
+    memcpy(events, data->genl_events, count * sizeof(events[0]));
+    data->genl_count = 0;
+    data->genl_dropped = 0;
+    spin_unlock(&data->genl_lock);
+
+    if (count == 0)
+        return;
+
+    skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+    if (!skb)
+        return;
+
+    hdr = genlmsg_put(skb, 0, 0, &chip_genl_family, 0,
+        CHIP_I2C_CMD_SWITCH_EVENTS);
+    if (!hdr)
+        goto free_skb;
+
+    if (nla_put_string(skb, CHIP_I2C_A_DEVICE, dev_name(data->dev)) ||
+        (dropped && nla_put_u32(skb, CHIP_I2C_A_DROPPED, dropped)))
+        goto free_skb;
+
+    for (i = 0; i < count; i++)
+    {
+        nest = nla_nest_start(skb, CHIP_I2C_A_EVENT);
+        if (!nest ||
+            nla_put_u64(skb, CHIP_I2C_EVENT_A_TIMESTAMP,
+                events[i].timestamp_ns) ||
+            nla_put_u8(skb, CHIP_I2C_EVENT_A_OLD, events[i].old) ||
+            nla_put_u8(skb, CHIP_I2C_EVENT_A_VALUE, events[i].value))
+            goto free_skb;
+        nla_nest_end(skb, nest);
+    }
+
+    genlmsg_end(skb, hdr);
+    genlmsg_multicast(skb, 0, chip_genl_mcgrp.id, GFP_KERNEL);
+    return;
+
+free_skb:
+    nlmsg_free(skb);
+}
+
+/* Periodic stats snapshot, the driver wide event counters and the
+ * bus occupancy of this client.
+ */
+static void chip_stats_work(struct work_struct *work)
+{
+    struct chip_data *data = container_of(to_delayed_work(work),
+        struct chip_data, stats_work);
+    unsigned int period = ACCESS_ONCE(data->stats_interval_ms);
+    struct sk_buff *skb;
+    void *hdr;
+
+    if (period)
+        schedule_delayed_work(&data->stats_work, msecs_to_jiffies(period));
+
+    skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+    if (!skb)
+        return;
+
+    hdr = genlmsg_put(skb, 0, 0, &chip_genl_family, 0, CHIP_I2C_CMD_STATS);
+    if (!hdr ||
+        nla_put_string(skb, CHIP_I2C_A_DEVICE, dev_name(data->dev)) ||
+        nla_put_u64(skb, CHIP_I2C_A_BUS_READS,
+            chip_counter_sum(CHIP_CNT_BUS_READS)) ||
+        nla_put_u64(skb, CHIP_I2C_A_BUS_WRITES,
+            chip_counter_sum(CHIP_CNT_BUS_WRITES)) ||
+        nla_put_u64(skb, CHIP_I2C_A_BUS_BYTES,
+            chip_counter_sum(CHIP_CNT_BUS_BYTES)) ||
+        nla_put_u64(skb, CHIP_I2C_A_LOCK_CONTENDED,
+            chip_counter_sum(CHIP_CNT_LOCK_CONTENDED)) ||
+        nla_put_u64(skb, CHIP_I2C_A_COALESCED_WRITES,
+            chip_counter_sum(CHIP_CNT_COALESCED_WRITES)) ||
+        nla_put_u64(skb, CHIP_I2C_A_BUS_ERRORS,
+            chip_counter_sum(CHIP_CNT_BUS_ERRORS)) ||
+        nla_put_u32(skb, CHIP_I2C_A_OCCUPANCY,
+            chip_occupancy_get(&data->occ, 1)))
+    {
+        nlmsg_free(skb);
+        return;
+    }
+
+    genlmsg_end(skb, hdr);
+    genlmsg_multicast(skb, 0, chip_genl_mcgrp.id, GFP_KERNEL);
+}
+
+static int chip_genl_init(void)
+{
+    int ret;
+
+    ret = genl_register_family(&chip_genl_family);
+    if (ret)
+        return ret;
+
+    ret = genl_register_mc_group(&chip_genl_family, &chip_genl_mcgrp);
+    if (ret)
+        genl_unregister_family(&chip_genl_family);
+
+    return ret;
+}
+
+/* Queue a switch event on every file of the client that was opened
+ * for reading and subscribed to it. A reader that falls behind loses
+ * its oldest events.
+ */
+static void chip_files_deliver(struct chip_data *data, u8 old, u8 value,
+    u8 coalesced)
+{
+    struct chip_i2c_event event = {
+        .timestamp_ns = ktime_to_ns(ktime_get()),
+        .old = old,
+        .value = value,
+        .changed = old ^ value,
+        .flags = (old ^ value) & coalesced ? CHIP_I2C_EVENT_COALESCED : 0,
+    };
+    u8 rising = (old ^ value) & value;
+    u8 falling = (old ^ value) & old;
+    struct chip_file *cf;
+    u8 wanted;
+
+    chip_files_lock();
+    list_for_each_entry(cf, &chip_files, list)
+    {
+        if (cf->data != data || !cf->reader)
+            continue;
+
+        /* Readers that didn't subscribe to any of the edges are
+         * not even woken up.
+         */
+        spin_lock(&cf->lock);
+        wanted = 0;
+        if (cf->sub_edges & CHIP_I2C_SUB_RISING)
+            wanted |= rising;
+        if (cf->sub_edges & CHIP_I2C_SUB_FALLING)
+            wanted |= falling;
+        if (!(wanted & cf->sub_mask))
+        {
+            spin_unlock(&cf->lock);
+            continue;
+        }
+
+        if (cf->ev_count == CHIP_FILE_EVENTS)
+        {
+            cf->ev_head = (cf->ev_head + 1) % CHIP_FILE_EVENTS;
+            cf->ev_count--;
+            cf->stats.events_dropped++;
+        }
+        cf->events[(cf->ev_head + cf->ev_count) % CHIP_FILE_EVENTS] = event;
+        cf->ev_count++;
+        cf->stats.events++;
+        spin_unlock(&cf->lock);
+
+        wake_up_interruptible(&cf->wait);
+    }
+    chip_files_unlock();
+}
+
+/* Report the switches in changed to the input device, all of them
+ * in a single SYN_REPORT.
+ */
+static void chip_input_report(struct chip_data *data, u8 changed, u8 value)
+{
+    int i;
+
+    if (!data->input)
+        return;
+
+    for (i = 0; i < 8; i++)
+        if (changed & (1 << i))
+            input_report_key(data->input, data->keymap[i],
+                value & (1 << i));
+    input_sync(data->input);
+}
+
+/* Tell user space that the switches changed. Programs can poll()
+ * chip_switch (after reading it once) to wait for this, read events
+ * from /dev/chip_i2c_leds or the input device, or listen on the
+ * chip_i2c generic netlink family.
+ */
+static void chip_switch_forward(struct chip_data *data, u8 old, u8 value,
+    u8 coalesced)
+{
+    sysfs_notify(&data->dev->kobj, NULL, "chip_switch");
+    chip_input_report(data, old ^ value, value);
+    chip_files_deliver(data, old, value, coalesced);
+    chip_genl_queue_event(data, old, value);
+}
+
+/* Run the attached switch handler for a change, or the reflex map if
+ * no handler is attached. Returns the CHIP_I2C_VERDICT_* flags for the
+ * event. Called with update_lock held.
+ */
+static int chip_switch_handle(struct chip_data *data, u8 old, u8 value)
+{
+    struct chip_i2c_switch_handler *handler;
+    int verdict = CHIP_I2C_VERDICT_FORWARD;
+    u8 olat = data->led_value;
+
+    down_read(&chip_handler_rwsem);
+    handler = chip_switch_handler;
+    if (handler)
+        verdict = handler->handle(handler, data->dev,
+            old, value, &olat);
+    up_read(&chip_handler_rwsem);
+
+    if (!handler)
+    {
+        chip_reflex_run(data, value);
+        return CHIP_I2C_VERDICT_FORWARD;
+    }
+
+    /* A failing handler must not hide the event from user space */
+    if (verdict < 0)
+        return CHIP_I2C_VERDICT_FORWARD;
+
+    if (verdict & CHIP_I2C_VERDICT_WRITE)
+    {
+        if (olat != data->led_value)
+            __chip_write_value(data, REG_CHIP_PORTA_LOUT, olat);
+        else
+            chip_count(CHIP_CNT_COALESCED_WRITES, 1);
+    }
+
+    return verdict;
+}
+
+/* The switch change path. Every PORTB value read from the bus, be
+ * it from a sysfs read, the sampler or the interrupt thread ends up
+ * here. We refresh the read cache and, if the switches changed, run
+ * the switch handler (or reflex map) and notify user space. Called
+ * with update_lock held so changes are seen in the order they were
+ * read from the chip.
+ *
+ * Switches in a storm (see __chip_storm_check()) are only reported
+ * by the storm sampler, with storm set, and their events are flagged
+ * as coalesced. Everybody else sees them at their last sampled value.
+ */
+static void __chip_switch_report(struct chip_data *data, u8 value,
+    bool storm)
+{
+    int old = data->switch_value;
+    u8 coalesced = 0;
+    int verdict;
+
+    if (old >= 0)
+    {
+        if (storm)
+            coalesced = data->storm_bits;
+        else
+            value = (value & ~data->storm_bits) |
+                (old & data->storm_bits);
+    }
+
+    chip_switch_store(data, value);
+    if (old == value)
+        return;
+
+    /* The very first read only establishes the initial state, and
+     * drives the leds from it unless a handler is attached.
+     */
+    if (old < 0)
+    {
+        chip_input_report(data, 0xFF, value);
+        chip_reflex_run(data, value);
+        return;
+    }
+
+    verdict = chip_switch_handle(data, old, value);
+    if (verdict & CHIP_I2C_VERDICT_FORWARD)
+        chip_switch_forward(data, old, value, coalesced);
+}
+
+static void __chip_switch_update(struct chip_data *data, u8 value)
+{
+    __chip_switch_report(data, value, false);
+}
+
+/* Other modules can attach their own logic to the switch change
+ * path, see chip_i2c.h. Only one handler can be attached at a time,
+ * and it replaces the reflex map while attached.
+ */
+int chip_i2c_register_switch_handler(struct chip_i2c_switch_handler *handler)
+{
+    int ret = 0;
+
+    if (!handler || !handler->handle)
+        return -EINVAL;
+
+    down_write(&chip_handler_rwsem);
+    if (chip_switch_handler)
+        ret = -EBUSY;
+    else
+        chip_switch_handler = handler;
+    up_write(&chip_handler_rwsem);
+
+    return ret;
+}
+EXPORT_SYMBOL_GPL(chip_i2c_register_switch_handler);
+
+/* Once this returns the handler is no longer running and will not
+ * be called again, so the caller's module can safely go away.
+ */
+void chip_i2c_unregister_switch_handler(struct chip_i2c_switch_handler *handler)
+{
+    down_write(&chip_handler_rwsem);
+    if (chip_switch_handler == handler)
+        chip_switch_handler = NULL;
+    up_write(&chip_handler_rwsem);
+}
+EXPORT_SYMBOL_GPL(chip_i2c_unregister_switch_handler);
+
+/* Returns the cached PORTB value if it is younger than the
+ * configured max age, -1 otherwise.
+ */
+static int chip_switch_fresh(struct chip_data *data)
+{
+    unsigned int max_age = ACCESS_ONCE(data->switch_max_age_ms);
+    unsigned long age;
+    int val;
+
+    if (max_age == 0)
+        return -1;
+
+    val = chip_switch_cached(data, &age);
+    if (val < 0 || age > msecs_to_jiffies(max_age))
+        return -1;
+
+    return val;
+}
+
+/* Reads the dip switches (PORTB).
+ *
+ * Reads within switch_max_age_ms of the last bus read are served
+ * from the cache without touching the bus or update_lock, so any
+ * number of pollers cost at most one bus read per window.
+ *
+ * If deadline_ms is non zero and we can not get to the bus in time
+ * (e.g. someone is flooding the leds with writes), the last known
+ * PORTB value is returned instead and flagged as stale. Note that the
+ * deadline only covers waiting for our own lock, the transfer itself
+ * is bounded by the adapter's timeout.
+ *
+ * Returns the PORTB value or a negative error code, *flags is set to
+ * a combination of CHIP_I2C_SWITCH_* flags.
+ */
+static int chip_read_switch(struct chip_data *data,
+    unsigned int deadline_ms, u8 *flags)
+{
+    unsigned long age;
+    int val;
+
+    *flags = CHIP_I2C_SWITCH_CACHED;
+    val = chip_switch_fresh(data);
+    if (val >= 0)
+        return val;
+
+    if (chip_lock_timeout(data, deadline_ms) < 0)
+    {
+        val = chip_switch_cached(data, &age);
+        if (val < 0)
+            return -ETIMEDOUT;
+
+        *flags = CHIP_I2C_SWITCH_STALE;
+        return val;
+    }
+
+    /* Someone else may have refreshed the cache while we waited */
+    val = chip_switch_fresh(data);
+    if (val < 0)
+    {
+        *flags = 0;
+        val = __chip_read_value(data, REG_CHIP_PORTB_LIN);
+        if (val >= 0)
+            __chip_switch_update(data, val);
+    }
+    chip_unlock(data);
+
+    return val;
+}
+
+/* Boards without the MCP23017 INTB line wired up can have the
+ * switches sampled periodically instead (chip_sample_interval).
+ */
+static void chip_sample_work(struct work_struct *work)
+{
+    struct chip_data *data = container_of(to_delayed_work(work),
+        struct chip_data, sample_work);
+    unsigned int period;
+    int val;
+
+    chip_lock(data);
+    val = __chip_read_value(data, REG_CHIP_PORTB_LIN);
+    if (val >= 0)
+        __chip_switch_update(data, val);
+    chip_unlock(data);
+
+    period = ACCESS_ONCE(data->sample_ms);
+    if (period)
+        schedule_delayed_work(&data->sample_work, msecs_to_jiffies(period));
+}
+
+/* Input capture. Every edge is recorded with its time in a ring
+ * mapped by user space. The interrupt thread is the only producer
+ * and user space the only consumer, so the ring needs no lock: the
+ * entry is written before head is published, and an entry is only
+ * reused once user space moved tail past it. A full ring drops the
+ * new edges. Caller holds update_lock.
+ */
+static void __chip_capture_push(struct chip_data *data, int pin, u8 edge,
+    ktime_t time, u8 flags)
+{
+    struct chip_i2c_capture_hdr *hdr = data->capture_hdr;
+    struct chip_i2c_capture *entry;
+    u32 head = data->capture_head;
+
+    if (head - ACCESS_ONCE(hdr->tail) >= CHIP_CAPTURE_ENTRIES)
+    {
+        ACCESS_ONCE(hdr->dropped)++;
+        return;
+    }
+
+    /* Don't let the entry be overwritten before tail was read */
+    smp_mb();
+    entry = &data->captures[head & (CHIP_CAPTURE_ENTRIES - 1)];
+    entry->timestamp_ns = ktime_to_ns(time);
+    entry->pin = pin;
+    entry->edge = edge;
+    entry->flags = flags;
+
+    smp_wmb();
+    data->capture_head = head + 1;
+    ACCESS_ONCE(hdr->head) = head + 1;
+}
+
+/* Edge counters. Every interrupt tells us which pins changed (INTF)
+ * and their state when it fired (INTCAP), so the transitions from
+ * the previous state to INTCAP and on to the current state are
+ * counted per pin, with no bus reads beyond the one the interrupt
+ * needs anyway. Caller holds update_lock.
+ */
+static void __chip_edges_count(struct chip_data *data, u8 from, u8 to,
+    u8 pins, ktime_t time, u8 flags)
+{
+    u8 rising = pins & ~from & to;
+    u8 falling = pins & from & ~to;
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        if (rising & (1 << i))
+        {
+            data->edge_rising[i]++;
+            if (data->capture)
+                __chip_capture_push(data, i, CHIP_I2C_EDGE_RISING,
+                    time, flags);
+        }
+        if (falling & (1 << i))
+        {
+            data->edge_falling[i]++;
+            if (data->capture)
+                __chip_capture_push(data, i, CHIP_I2C_EDGE_FALLING,
+                    time, flags);
+        }
+    }
+}
+
+/* The edges that raised the interrupt get its time, taken in the
+ * hard irq handler. Edges that came after it only show up in the
+ * current port value, they get the time of the bus read and are
+ * flagged as such.
+ */
+static void __chip_edges_update(struct chip_data *data, u8 intf, u8 intcap,
+    u8 value)
+{
+    ktime_t now = ktime_get();
+
+    if (data->edge_valid)
+    {
+        __chip_edges_count(data, data->edge_last, intcap, intf,
+            data->irq_time, 0);
+        __chip_edges_count(data, intcap, value, intf, now,
+            CHIP_I2C_CAPTURE_LATE);
+        __chip_edges_count(data, data->edge_last, value, ~intf, now,
+            CHIP_I2C_CAPTURE_LATE);
+    }
+    data->edge_last = value;
+    data->edge_valid = true;
+}
+
+/* Derive the pins' frequency from the rising edges of each gate */
+static void chip_edge_work(struct work_struct *work)
+{
+    struct chip_data *data = container_of(to_delayed_work(work),
+        struct chip_data, edge_work);
+    unsigned int gate = ACCESS_ONCE(data->edge_gate_ms);
+    u64 edges;
+    int i;
+
+    if (!gate)
+        return;
+
+    chip_lock(data);
+    for (i = 0; i < 8; i++)
+    {
+        edges = data->edge_rising[i] - data->edge_gate_start[i];
+        data->edge_freq_mhz[i] = div_u64(edges * 1000000, gate);
+        data->edge_gate_start[i] = data->edge_rising[i];
+    }
+    chip_unlock(data);
+
+    schedule_delayed_work(&data->edge_work, msecs_to_jiffies(gate));
+}
+
+/* Program the per switch interrupt mode into the chip. Pins set in
+ * compare interrupt while they differ from their defval bit, the
+ * other enabled pins on any change. Pins in an interrupt storm, and
+ * compare pins held away from their defval, stay off. Caller holds
+ * update_lock.
+ */
+static int __chip_irq_program(struct chip_data *data)
+{
+    struct chip_i2c_irq_mode *mode = &data->irq_mode;
+    int ret;
+
+    ret = __chip_write_value(data, REG_CHIP_DEFVALB, mode->defval);
+    if (ret == 0)
+        ret = __chip_write_value(data, REG_CHIP_INTCONB, mode->compare);
+    if (ret == 0)
+        ret = __chip_write_value(data, REG_CHIP_GPINTENB,
+            mode->enable & ~(data->storm_bits | data->irq_held));
+
+    return ret;
+}
+
+/* A compare switch keeps INTB asserted for as long as it differs from
+ * DEFVAL, which with our level triggered oneshot interrupt would fire
+ * again as soon as the thread returns. So a compare switch that left
+ * its defval is held: its interrupt is turned off and hold_work
+ * samples it every CHIP_HOLD_SAMPLE_MS until it is back at its
+ * defval, which turns the interrupt on again. A switch only
+ * interrupts when it leaves its defval. Caller holds update_lock.
+ */
+static void __chip_irq_hold(struct chip_data *data, u8 value)
+{
+    struct chip_i2c_irq_mode *mode = &data->irq_mode;
+    u8 away = mode->enable & mode->compare & (value ^ mode->defval);
+
+    away &= ~data->irq_held;
+    if (!away)
+        return;
+
+    data->irq_held |= away;
+    __chip_irq_program(data);
+    schedule_delayed_work(&data->hold_work,
+        msecs_to_jiffies(CHIP_HOLD_SAMPLE_MS));
+}
+
+static void chip_hold_work(struct work_struct *work)
+{
+    struct chip_data *data = container_of(to_delayed_work(work),
+        struct chip_data, hold_work);
+    bool holding;
+    u8 back;
+    int val;
+
+    chip_lock(data);
+    val = __chip_read_value(data, REG_CHIP_PORTB_LIN);
+    if (val >= 0)
+    {
+        __chip_switch_update(data, val);
+        back = data->irq_held & ~(val ^ data->irq_mode.defval);
+        if (back)
+        {
+            data->irq_held &= ~back;
+            __chip_irq_program(data);
+        }
+    }
+    holding = data->irq_held != 0;
+    chip_unlock(data);
+
+    if (holding)
+        schedule_delayed_work(&data->hold_work,
+            msecs_to_jiffies(CHIP_HOLD_SAMPLE_MS));
+}
+
+static int chip_irq_mode_set(struct chip_data *data,
+    const struct chip_i2c_irq_mode *mode)
+{
+    int ret;
+
+    if (data->bus.irq <= 0)
+        return -ENODEV;
+
+    chip_lock(data);
+    data->irq_mode.enable = mode->enable;
+    data->irq_mode.compare = mode->compare;
+    data->irq_mode.defval = mode->defval;
+    /* Switches still away from their new defval interrupt right away
+     * and get held again.
+     */
+    data->irq_held = 0;
+    ret = __chip_irq_program(data);
+    chip_unlock(data);
+
+    return ret;
+}
+
+/* Interrupt storm protection. A chattering switch can interrupt
+ * thousands of times a second, each costing a bus read and waking
+ * every consumer. The interrupts of each switch are counted over
+ * CHIP_STORM_WINDOW_MS, a switch going over storm_rate gets its
+ * interrupt turned off and is sampled every CHIP_STORM_SAMPLE_MS
+ * instead, so consumers only see the coalesced changes. Once the
+ * storming switches were quiet for CHIP_STORM_QUIET_MS, their
+ * interrupts are turned back on. Caller holds update_lock.
+ */
+static void __chip_storm_check(struct chip_data *data, u8 intf)
+{
+    unsigned int limit;
+    u8 storm = 0;
+    int i;
+
+    /* Round up, a low rate must not turn into a limit of 0 */
+    limit = DIV_ROUND_UP(ACCESS_ONCE(data->storm_rate) *
+        CHIP_STORM_WINDOW_MS, 1000);
+    if (!limit)
+        return;
+
+    if (time_after(jiffies, data->storm_window +
+            msecs_to_jiffies(CHIP_STORM_WINDOW_MS)))
+    {
+        memset(data->storm_counts, 0, sizeof(data->storm_counts));
+        data->storm_window = jiffies;
+    }
+
+    for (i = 0; i < 8; i++)
+        if ((intf & (1 << i)) && ++data->storm_counts[i] > limit)
+            storm |= 1 << i;
+
+    storm &= ~data->storm_bits;
+    if (!storm)
+        return;
+
+    dev_warn(data->dev, "Interrupt storm on switches 0x%02x, "
+        "sampling them instead\n", storm);
+    data->storm_bits |= storm;
+    data->storm_active = jiffies;
+    __chip_irq_program(data);
+    schedule_delayed_work(&data->storm_work,
+        msecs_to_jiffies(CHIP_STORM_SAMPLE_MS));
+}
+
+static void chip_storm_work(struct work_struct *work)
+{
+    struct chip_data *data = container_of(to_delayed_work(work),
+        struct chip_data, storm_work);
+    bool storming;
+    int val;
+
+    chip_lock(data);
+    val = __chip_read_value(data, REG_CHIP_PORTB_LIN);
+    if (val >= 0)
+    {
+        if ((val ^ data->switch_value) & data->storm_bits)
+            data->storm_active = jiffies;
+        __chip_switch_report(data, val, true);
+    }
+
+    if (time_after(jiffies, data->storm_active +
+            msecs_to_jiffies(CHIP_STORM_QUIET_MS)))
+    {
+        dev_info(data->dev, "Switches 0x%02x quiet again\n",
+            data->storm_bits);
+        data->storm_bits = 0;
+        memset(data->storm_counts, 0, sizeof(data->storm_counts));
+        __chip_irq_program(data);
+    }
+    storming = data->storm_bits != 0;
+    chip_unlock(data);
+
+    if (storming)
+        schedule_delayed_work(&data->storm_work,
+            msecs_to_jiffies(CHIP_STORM_SAMPLE_MS));
+}
+
+/* The hard irq half only takes the time of the edge, before any
+ * bus latency. The line stays masked until the thread is done
+ * (IRQF_ONESHOT), so irq_time can't be overwritten under it.
+ */
+static irqreturn_t chip_i2c_irq(int irq, void *dev_id)
+{
+    struct chip_data *data = dev_id;
+
+    data->irq_time = ktime_get();
+    return IRQ_WAKE_THREAD;
+}
+
+/* If the client has an interrupt (INTB of the MCP23017), we get
+ * called whenever a switch changes. We read INTFB, the captures and
+ * both ports in one go (the MCP23017 steps through the registers by
+ * itself), which also clears the interrupt on the chip.
+ */
+static irqreturn_t chip_i2c_irq_thread(int irq, void *dev_id)
+{
+    struct chip_data *data = dev_id;
+    u8 regs[5];     /* INTFB, INTCAPA, INTCAPB, GPIOA, GPIOB */
+
+    chip_lock(data);
+    if (__chip_read_block(data, REG_CHIP_INTFB, regs, sizeof(regs)) >= 0)
+    {
+        __chip_storm_check(data, regs[0]);
+        __chip_irq_hold(data, regs[4]);
+        __chip_edges_update(data, regs[0], regs[2], regs[4]);
+        __chip_switch_update(data, regs[4]);
+    }
+    chip_unlock(data);
+
+    return IRQ_HANDLED;
+}
+
+/* Submission/completion rings (see chip_i2c.h). User space posts
+ * register operations to a submission ring (SQ) shared through
+ * mmap(), and a kernel thread drains it to the bus and posts the
+ * results to the completion ring (CQ). With CHIP_I2C_RING_SQPOLL
+ * the thread keeps polling the SQ for sq_idle_ms after the last
+ * submission, so a busy producer never has to enter the kernel.
+ */
+#define CHIP_RING_MAX_ENTRIES   4096
+#define CHIP_RING_MAX_IDLE_MS   1000
+#define CHIP_RING_BATCH         16      /* SQEs per update_lock hold */
+
+struct chip_ring {
+    struct chip_data * data;
+    struct chip_file * file;
+    void * mem;                         /* vmalloc_user(), mmap()ed */
+    size_t size;
+    struct chip_i2c_ring_hdr * hdr;
+    struct chip_i2c_sqe * sqes;
+    struct chip_i2c_cqe * cqes;
+    u32 sq_entries;                     /* Our own copies, the header */
+    u32 cq_entries;                     /* is writable by user space */
+    u32 sq_head;
+    u32 cq_tail;
+    u32 flags;
+    unsigned int idle_ms;
+    struct eventfd_ctx * eventfd;
+    struct task_struct * thread;
+    wait_queue_head_t sq_wait;          /* The thread waits for SQEs */
+    wait_queue_head_t cq_wait;          /* Callers wait for CQEs */
+};
+
+static bool chip_ring_sq_ready(struct chip_ring *ring)
+{
+    u32 cq_head = ACCESS_ONCE(ring->hdr->cq_head);
+
+    return ACCESS_ONCE(ring->hdr->sq_tail) != ring->sq_head &&
+        ring->cq_tail - cq_head < ring->cq_entries;
+}
+
+/* Change the leds in mask on behalf of an open file, under the
+ * client's led policy. Caller holds update_lock.
+ *
+ * Under the owner policy every file only keeps the bits it claimed
+ * in led_owner_bits, and PORTA is composed from those and the
+ * unclaimed bits of led_value. A change by any owner is a single
+ * write of the composed value, no read-modify-write by user space,
+ * and no write at all if the composed value didn't change.
+ */
+static int __chip_file_led_bits(struct chip_file *cf, u8 mask, u8 value)
+{
+    struct chip_data *data = cf->data;
+    u8 out;
+    int ret;
+
+    if (data->led_policy == CHIP_LED_OWNER)
+    {
+        /* A file without a claim has nothing to write */
+        if (!cf->owned)
+            return -EPERM;
+        mask &= cf->owned;
+        data->led_owner_bits = (data->led_owner_bits & ~mask) |
+            (value & mask);
+        out = (data->led_value & ~data->led_owned) |
+            (data->led_owner_bits & data->led_owned);
+        if (out == data->led_value)
+        {
+            chip_count(CHIP_CNT_COALESCED_WRITES, 1);
+            return 0;
+        }
+    }
+    else
+        out = (data->led_value & ~mask) | (value & mask);
+
+    ret = __chip_write_value(data, REG_CHIP_PORTA_LOUT, out);
+    cf->stats.writes++;
+    if (ret < 0)
+        cf->stats.write_errors++;
+
+    return ret;
+}
+
+static int __chip_file_led_write(struct chip_file *cf, u8 value)
+{
+    return __chip_file_led_bits(cf, 0xFF, value);
+}
+
+/* The same for writers that aren't open files: the chip_led file,
+ * the framebuffer, frames and other drivers. They can't claim leds,
+ * so under the owner policy they only change the unclaimed ones.
+ * Caller holds update_lock.
+ */
+static int __chip_led_bits(struct chip_data *data, u8 mask, u8 value)
+{
+    u8 out;
+
+    if (data->led_policy == CHIP_LED_OWNER)
+        mask &= ~data->led_owned;
+
+    out = (data->led_value & ~mask) | (value & mask);
+    if (out == data->led_value)
+    {
+        chip_count(CHIP_CNT_COALESCED_WRITES, 1);
+        return 0;
+    }
+
+    return __chip_write_value(data, REG_CHIP_PORTA_LOUT, out);
+}
+
+/* Run one SQE against the chip, caller holds update_lock. User space
+ * may only write the leds and read the port/latch registers, the
+ * rest of the chip's setup belongs to the driver.
+ */
+static int chip_ring_exec(struct chip_ring *ring,
+    const struct chip_i2c_sqe *sqe)
+{
+    struct chip_data *data = ring->data;
+    int ret;
+
+    switch (sqe->opcode)
+    {
+    case CHIP_I2C_OP_READ:
+        if (sqe->reg < REG_CHIP_PORTA_LIN || sqe->reg > REG_CHIP_PORTB_LOUT)
+            return -EINVAL;
+        ret = __chip_read_value(data, sqe->reg);
+        if (ret >= 0 && sqe->reg == REG_CHIP_PORTB_LIN)
+            __chip_switch_update(data, ret);
+        return ret;
+
+    case CHIP_I2C_OP_WRITE:
+        if (sqe->reg != REG_CHIP_PORTA_LOUT)
+            return -EINVAL;
+        return __chip_file_led_write(ring->file, sqe->value);
+
+    default:
+        return -EINVAL;
+    }
+}
+
+/* Drain the SQ to the bus in batches of CHIP_RING_BATCH entries per
+ * update_lock hold. We stop when the CQ is full rather than drop a
+ * completion, the SQ is picked up again once user space reaps the CQ.
+ * Returns the number of SQEs consumed.
+ */
+static int chip_ring_drain(struct chip_ring *ring)
+{
+    struct chip_i2c_ring_hdr *hdr = ring->hdr;
+    struct chip_i2c_sqe sqe;
+    struct chip_i2c_cqe *cqe;
+    int done = 0, batch;
+
+    while (chip_ring_sq_ready(ring))
+    {
+        chip_lock(ring->data);
+        for (batch = 0; batch < CHIP_RING_BATCH && chip_ring_sq_ready(ring);
+            batch++)
+        {
+            /* Read the SQE only after seeing the tail that covers it,
+             * every check above may have seen a newer one.
+             */
+            smp_rmb();
+
+            /* Copy the entry, user space can change it under us */
+            sqe = ring->sqes[ring->sq_head & (ring->sq_entries - 1)];
+            ring->sq_head++;
+
+            cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+            cqe->user_data = sqe.user_data;
+            cqe->res = chip_ring_exec(ring, &sqe);
+            cqe->flags = 0;
+            ring->cq_tail++;
+        }
+        chip_unlock(ring->data);
+
+        /* Publish the CQEs before the new tail */
+        smp_wmb();
+        ACCESS_ONCE(hdr->cq_tail) = ring->cq_tail;
+        ACCESS_ONCE(hdr->sq_head) = ring->sq_head;
+        done += batch;
+
+        wake_up_interruptible(&ring->cq_wait);
+        if (ring->eventfd)
+            eventfd_signal(ring->eventfd, 1);
+    }
+
+    return done;
+}
+
+static int chip_ring_thread(void *arg)
+{
+    struct chip_ring *ring = arg;
+    struct chip_i2c_ring_hdr *hdr = ring->hdr;
+    unsigned long idle_until = jiffies;
+
+    while (!kthread_should_stop())
+    {
+        if (chip_ring_drain(ring))
+        {
+            idle_until = jiffies + msecs_to_jiffies(ring->idle_ms);
+            continue;
+        }
+
+        if ((ring->flags & CHIP_I2C_RING_SQPOLL) &&
+            time_before(jiffies, idle_until))
+        {
+            cond_resched();
+            continue;
+        }
+
+        /* Going to sleep, tell user space it needs to kick us
+         * (CHIP_I2C_IOC_RING_ENTER) and check once more for SQEs
+         * that raced with setting the flag.
+         */
+        ACCESS_ONCE(hdr->sq_flags) |= CHIP_I2C_SQ_NEED_WAKEUP;
+        smp_mb();
+        wait_event_interruptible(ring->sq_wait,
+            chip_ring_sq_ready(ring) || kthread_should_stop());
+        ACCESS_ONCE(hdr->sq_flags) &= ~CHIP_I2C_SQ_NEED_WAKEUP;
+        idle_until = jiffies + msecs_to_jiffies(ring->idle_ms);
+    }
+
+    return 0;
+}
+
+static void chip_ring_free(struct chip_ring *ring)
+{
+    if (ring->thread)
+        kthread_stop(ring->thread);
+    if (ring->eventfd)
+        eventfd_ctx_put(ring->eventfd);
+    vfree(ring->mem);
+    kfree(ring);
+}
+
+/* Set up the rings of an open file (CHIP_I2C_IOC_RING_SETUP) */
+static int chip_ring_setup(struct chip_file *cf,
+    struct chip_i2c_ring_setup *setup)
+{
+    struct chip_ring *ring;
+    int err;
+
+    if (cf->ring)
+        return -EBUSY;
+
+    if (!setup->sq_entries || setup->sq_entries > CHIP_RING_MAX_ENTRIES ||
+        !is_power_of_2(setup->sq_entries) ||
+        !setup->cq_entries || setup->cq_entries > CHIP_RING_MAX_ENTRIES ||
+        !is_power_of_2(setup->cq_entries) ||
+        setup->flags & ~CHIP_I2C_RING_SQPOLL ||
+        setup->sq_idle_ms > CHIP_RING_MAX_IDLE_MS)
+        return -EINVAL;
+
+    ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    ring->data = cf->data;
+    ring->file = cf;
+    ring->sq_entries = setup->sq_entries;
+    ring->cq_entries = setup->cq_entries;
+    ring->flags = setup->flags;
+    ring->idle_ms = setup->sq_idle_ms;
+    init_waitqueue_head(&ring->sq_wait);
+    init_waitqueue_head(&ring->cq_wait);
+
+    setup->sq_off = L1_CACHE_ALIGN(sizeof(struct chip_i2c_ring_hdr));
+    setup->cq_off = L1_CACHE_ALIGN(setup->sq_off +
+        ring->sq_entries * sizeof(struct chip_i2c_sqe));
+    setup->size = PAGE_ALIGN(setup->cq_off +
+        ring->cq_entries * sizeof(struct chip_i2c_cqe));
+
+    ring->size = setup->size;
+    ring->mem = vmalloc_user(ring->size);
+    if (!ring->mem)
+    {
+        err = -ENOMEM;
+        goto free_ring;
+    }
+    ring->hdr = ring->mem;
+    ring->sqes = ring->mem + setup->sq_off;
+    ring->cqes = ring->mem + setup->cq_off;
+
+    if (setup->eventfd >= 0)
+    {
+        ring->eventfd = eventfd_ctx_fdget(setup->eventfd);
+        if (IS_ERR(ring->eventfd))
+        {
+            err = PTR_ERR(ring->eventfd);
+            ring->eventfd = NULL;
+            goto free_ring;
+        }
+    }
+
+    ring->thread = kthread_run(chip_ring_thread, ring, "chip_i2c_sq");
+    if (IS_ERR(ring->thread))
+    {
+        err = PTR_ERR(ring->thread);
+        ring->thread = NULL;
+        goto free_ring;
+    }
+
+    /* Two setups can race on the same file, the first one wins */
+    if (cmpxchg(&cf->ring, NULL, ring) != NULL)
+    {
+        err = -EBUSY;
+        goto free_ring;
+    }
+    return 0;
+
+free_ring:
+    chip_ring_free(ring);
+    return err;
+}
+
+static bool chip_ring_cq_ready(struct chip_ring *ring,
+    unsigned int min_complete)
+{
+    return ACCESS_ONCE(ring->cq_tail) -
+        ACCESS_ONCE(ring->hdr->cq_head) >= min_complete;
+}
+
+/* Kick the SQ thread and optionally wait for min_complete CQEs to
+ * be available (CHIP_I2C_IOC_RING_ENTER). Like io_uring, this waits
+ * for the CQEs even if they have not been submitted yet.
+ */
+static int chip_ring_enter(struct chip_ring *ring, unsigned int min_complete)
+{
+    int ret;
+
+    if (min_complete > ring->cq_entries)
+        return -EINVAL;
+
+    wake_up_interruptible(&ring->sq_wait);
+
+    if (min_complete == 0)
+        return 0;
+
+    ret = wait_event_interruptible(ring->cq_wait,
+        chip_ring_cq_ready(ring, min_complete) ||
+        ACCESS_ONCE(ring->data->dead));
+    if (ret)
+        return ret;
+
+    return chip_ring_cq_ready(ring, min_complete) ? 0 : -ENODEV;
+}
+
+/* The led framebuffer, done the way fb_deferred_io does it. User
+ * space maps a page at CHIP_I2C_FB_OFFSET and stores to it, the first
+ * store after a flush write faults into chip_fb_mkwrite, which
+ * schedules chip_fb_work. That write protects the page again and
+ * writes the leds if they changed, so any number of stores within
+ * fb_delay_ms cost at most one bus write.
+ */
+static void chip_fb_work(struct work_struct *work)
+{
+    struct chip_data *data = container_of(work, struct chip_data,
+        fb_work.work);
+    struct page *page = data->fb_page;
+    u8 value;
+
+    /* Clean the ptes before reading, stores from here on fault
+     * and schedule another flush.
+     */
+    lock_page(page);
+    page_mkclean(page);
+    unlock_page(page);
+
+    /* The page is written like any other writer that isn't an open
+     * file, through the led policy. If the policy kept some of the
+     * stores off the leds, show what the leds really are.
+     */
+    chip_lock(data);
+    value = ACCESS_ONCE(*(u8 *)page_address(page));
+    __chip_led_bits(data, 0xFF, value);
+    if (data->led_value != value)
+        chip_fb_show(data, data->led_value);
+    chip_unlock(data);
+}
+
+/* The mapping pins the file, and the file the chip's data, so the
+ * data is still around here. The chip may not be.
+ */
+static int chip_fb_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    struct chip_data *data = vma->vm_private_data;
+    struct page *page = data->fb_page;
+
+    if (vmf->pgoff != vma->vm_pgoff || ACCESS_ONCE(data->dead))
+        return VM_FAULT_SIGBUS;
+
+    get_page(page);
+    /* page_mkclean() needs to find the mapping */
+    page->mapping = vma->vm_file->f_mapping;
+    page->index = vmf->pgoff;
+    vmf->page = page;
+
+    return 0;
+}
+
+static int chip_fb_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    struct chip_data *data = vma->vm_private_data;
+
+    /* Don't queue a flush behind chip_core_remove() */
+    if (ACCESS_ONCE(data->dead))
+        return VM_FAULT_SIGBUS;
+
+    lock_page(vmf->page);
+    schedule_delayed_work(&data->fb_work,
+        msecs_to_jiffies(ACCESS_ONCE(data->fb_delay_ms)));
+
+    return VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct chip_fb_vm_ops = {
+    .fault = chip_fb_fault,
+    .page_mkwrite = chip_fb_mkwrite,
+};
+
+/* Keep the generic code from treating our page as a block device's */
+static int chip_fb_set_page_dirty(struct page *page)
+{
+    if (!PageDirty(page))
+        SetPageDirty(page);
+    return 0;
+}
+
+static const struct address_space_operations chip_fb_aops = {
+    .set_page_dirty = chip_fb_set_page_dirty,
+};
+
+static int chip_fb_mmap(struct file * fp, struct vm_area_struct * vma)
+{
+    struct chip_file * cf = fp->private_data;
+
+    if (vma->vm_end - vma->vm_start > PAGE_SIZE ||
+        !(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    /* Start from the leds as they are */
+    chip_lock(cf->data);
+    chip_fb_show(cf->data, cf->data->led_value);
+    chip_unlock(cf->data);
+
+    fp->f_mapping->a_ops = &chip_fb_aops;
+    vma->vm_ops = &chip_fb_vm_ops;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_private_data = cf->data;
+
+    return 0;
+}
+
+static int chip_i2c_mmap(struct file * fp, struct vm_area_struct * vma)
+{
+    struct chip_file * cf = fp->private_data;
+    struct chip_ring * ring;
+
+    if (ACCESS_ONCE(cf->data->dead))
+        return -ENODEV;
+
+    if (vma->vm_pgoff == CHIP_I2C_FB_OFFSET >> PAGE_SHIFT)
+        return chip_fb_mmap(fp, vma);
+
+    if (vma->vm_pgoff == CHIP_I2C_CAPTURE_OFFSET >> PAGE_SHIFT)
+    {
+        if (cf->data->capture_mem == NULL)
+            return -ENODEV;
+        /* Consuming the ring means storing tail, a read only mapping
+         * would fill the ring once and then drop everything.
+         */
+        if (!(vma->vm_flags & VM_WRITE) || !(vma->vm_flags & VM_SHARED))
+            return -EACCES;
+        return remap_vmalloc_range(vma, cf->data->capture_mem, 0);
+    }
+
+    ring = ACCESS_ONCE(cf->ring);
+    if (ring == NULL || vma->vm_pgoff != 0)
+        return -EINVAL;
+
+    return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+/* Fair interleaving. write() queues the bytes on the file and this
+ * worker takes one byte of every file with pending writes per pass,
+ * so a file writing a long burst can't starve the others.
+ */
+static void chip_fair_work(struct work_struct *work)
+{
+    struct chip_data *data = container_of(work, struct chip_data,
+        fair_work);
+    struct chip_file *cf;
+    bool more;
+    u8 value;
+
+    do {
+        more = false;
+
+        chip_lock(data);
+        chip_files_lock();
+        list_for_each_entry(cf, &chip_files, list)
+        {
+            if (cf->data != data)
+                continue;
+
+            spin_lock(&cf->lock);
+            if (cf->fair_count == 0)
+            {
+                spin_unlock(&cf->lock);
+                continue;
+            }
+            value = cf->fair[cf->fair_head];
+            cf->fair_head = (cf->fair_head + 1) % CHIP_FAIR_QUEUE;
+            cf->fair_count--;
+            if (cf->fair_count)
+                more = true;
+            spin_unlock(&cf->lock);
+
+            __chip_file_led_write(cf, value);
+            wake_up_interruptible(&cf->wait);
+        }
+        chip_files_unlock();
+        chip_unlock(data);
+
+        cond_resched();
+    } while (more);
+}
+
+static bool chip_fair_space(struct chip_file *cf)
+{
+    return ACCESS_ONCE(cf->fair_count) < CHIP_FAIR_QUEUE;
+}
+
+static ssize_t chip_fair_write(struct chip_file *cf, const u8 *buf,
+    size_t count, bool nonblock)
+{
+    size_t done = 0;
+    int ret;
+
+    for (;;)
+    {
+        spin_lock(&cf->lock);
+        while (done < count && cf->fair_count < CHIP_FAIR_QUEUE)
+        {
+            cf->fair[(cf->fair_head + cf->fair_count) % CHIP_FAIR_QUEUE] =
+                buf[done++];
+            cf->fair_count++;
+        }
+        spin_unlock(&cf->lock);
+        schedule_work(&cf->data->fair_work);
+
+        if (done == count)
+            return done;
+        if (nonblock)
+            return done ? done : -EAGAIN;
+
+        ret = wait_event_interruptible(cf->wait, chip_fair_space(cf) ||
+            ACCESS_ONCE(cf->data->dead));
+        if (ret)
+            return done ? done : ret;
+        if (ACCESS_ONCE(cf->data->dead))
+            return done ? done : -ENODEV;
+    }
+}
+
+static bool chip_file_has_events(struct chip_file *cf)
+{
+    return ACCESS_ONCE(cf->ev_count) != 0;
+}
+
+static bool chip_file_pop_event(struct chip_file *cf,
+    struct chip_i2c_event *event)
+{
+    bool ret = false;
+
+    spin_lock(&cf->lock);
+    if (cf->ev_count)
+    {
+        *event = cf->events[cf->ev_head];
+        cf->ev_head = (cf->ev_head + 1) % CHIP_FILE_EVENTS;
+        cf->ev_count--;
+        ret = true;
+    }
+    spin_unlock(&cf->lock);
+
+    return ret;
+}
+
+/* Claim a set of leds for a file under the owner policy. Claims are
+ * exclusive, a claim replaces the file's previous one and 0 drops it.
+ * Newly claimed leds keep their current state until the owner
+ * changes them, dropped ones keep the state their owner left.
+ */
+static int chip_file_claim(struct chip_file *cf, u8 mask)
+{
+    struct chip_data *data = cf->data;
+    struct chip_file *other;
+    u8 added;
+    int ret = 0;
+
+    chip_lock(data);
+    chip_files_lock();
+    list_for_each_entry(other, &chip_files, list)
+        if (other != cf && other->data == data && (other->owned & mask))
+        {
+            ret = -EBUSY;
+            break;
+        }
+    if (ret == 0)
+    {
+        added = mask & ~cf->owned;
+        data->led_owner_bits = (data->led_owner_bits & ~added) |
+            (data->led_value & added);
+        data->led_owned = (data->led_owned & ~cf->owned) | mask;
+        cf->owned = mask;
+    }
+    chip_files_unlock();
+    chip_unlock(data);
+
+    return ret;
+}
+
+/* The in kernel API (see chip_i2c.h). Other drivers queue requests on
+ * a device's submit_list, from any context, and submit_work runs them
+ * in batches under update_lock. Completions are called from the work,
+ * outside of update_lock.
+ */
+#define CHIP_SUBMIT_BATCH       16      /* Requests per update_lock hold */
+
+static int __chip_submit_exec(struct chip_data *data,
+    struct chip_i2c_request *req)
+{
+    int ret;
+
+    switch (req->op)
+    {
+    case CHIP_I2C_OP_READ:
+        if (req->reg < REG_CHIP_PORTA_LIN || req->reg > REG_CHIP_PORTB_LOUT)
+            return -EINVAL;
+        ret = __chip_read_value(data, req->reg);
+        if (ret >= 0 && req->reg == REG_CHIP_PORTB_LIN)
+            __chip_switch_update(data, ret);
+        return ret;
+
+    case CHIP_I2C_OP_WRITE:
+        if (req->reg != REG_CHIP_PORTA_LOUT)
+            return -EINVAL;
+        return __chip_led_bits(data, 0xFF, req->value);
+    }
+
+    return -EINVAL;
+}
+
+static void chip_submit_work(struct work_struct *work)
+{
+    struct chip_data *data = container_of(work, struct chip_data,
+        submit_work);
+    struct chip_i2c_request *req, *tmp;
+    LIST_HEAD(batch);
+    int n;
+
+    for (;;)
+    {
+        spin_lock_irq(&data->submit_lock);
+        for (n = 0; n < CHIP_SUBMIT_BATCH && !list_empty(&data->submit_list);
+            n++)
+            list_move_tail(data->submit_list.next, &batch);
+        spin_unlock_irq(&data->submit_lock);
+
+        if (list_empty(&batch))
+            return;
+
+        chip_lock(data);
+        list_for_each_entry(req, &batch, node)
+            req->result = __chip_submit_exec(data, req);
+        chip_unlock(data);
+
+        list_for_each_entry_safe(req, tmp, &batch, node)
+        {
+            list_del(&req->node);
+            req->complete(req);
+            put_device(data->dev);
+            module_put(THIS_MODULE);
+        }
+    }
+}
+
+int chip_i2c_submit(struct device *dev, struct chip_i2c_request *req)
+{
+    struct chip_data *data;
+    unsigned long flags;
+    int ret = 0;
+
+    /* Both transports are part of this module */
+    if (!dev || !dev->driver || dev->driver->owner != THIS_MODULE)
+        return -ENODEV;
+    if (!req || !req->complete)
+        return -EINVAL;
+
+    data = dev_get_drvdata(dev);
+    if (!data)
+        return -ENODEV;
+
+    /* Every queued request pins the module and the device until it
+     * completed. The caller has to keep the device bound while in
+     * here, chip_core_remove() only waits for queued requests.
+     */
+    if (!try_module_get(THIS_MODULE))
+        return -ENODEV;
+    get_device(dev);
+
+    spin_lock_irqsave(&data->submit_lock, flags);
+    if (data->submit_dead)
+        ret = -ENODEV;
+    else
+        list_add_tail(&req->node, &data->submit_list);
+    spin_unlock_irqrestore(&data->submit_lock, flags);
+
+    if (ret == 0)
+        schedule_work(&data->submit_work);
+    else
+    {
+        put_device(dev);
+        module_put(THIS_MODULE);
+    }
+
+    return ret;
+}
+EXPORT_SYMBOL_GPL(chip_i2c_submit);
+
+static void chip_submit_complete(struct chip_i2c_request *req)
+{
+    complete(req->context);
+}
+
+static int chip_submit_sync(struct device *dev, u8 op, u8 reg, u8 value)
+{
+    DECLARE_COMPLETION_ONSTACK(done);
+    struct chip_i2c_request req = {
+        .op = op,
+        .reg = reg,
+        .value = value,
+        .complete = chip_submit_complete,
+        .context = &done,
+    };
+    int ret;
+
+    ret = chip_i2c_submit(dev, &req);
+    if (ret)
+        return ret;
+
+    wait_for_completion(&done);
+    return req.result;
+}
+
+int chip_i2c_read(struct device *dev, u8 reg)
+{
+    return chip_submit_sync(dev, CHIP_I2C_OP_READ, reg, 0);
+}
+EXPORT_SYMBOL_GPL(chip_i2c_read);
+
+int chip_i2c_write(struct device *dev, u8 reg, u8 value)
+{
+    return chip_submit_sync(dev, CHIP_I2C_OP_WRITE, reg, value);
+}
+EXPORT_SYMBOL_GPL(chip_i2c_write);
+
+/* Double buffered frames. CHIP_I2C_IOC_FRAME_SET draws into the back
+ * buffer and CHIP_I2C_IOC_FRAME_COMMIT writes both output latches in
+ * a single transfer, so the leds never show a half drawn frame.
+ * Each frame starts out as a copy of the latches, so bits a frame
+ * doesn't draw keep what others wrote since the last commit.
+ *
+ * With frame_rate set, commits are paced like vsync: a commit waits
+ * for the next frame slot after the previous frame. A commit that
+ * arrives after its slot went by goes out right away and is counted
+ * as missed, unless the stream was idle for more than a frame.
+ */
+static void __chip_frame_begin(struct chip_data *data)
+{
+    if (!data->frame_open)
+    {
+        data->frame_back[0] = data->led_value;
+        data->frame_back[1] = data->olatb_value;
+        data->frame_open = true;
+    }
+}
+
+static int chip_frame_commit(struct chip_data *data)
+{
+    unsigned int rate;
+    ktime_t now, slot;
+    s64 late_ns = 0;
+    u8 frame[2];
+    int ret;
+
+    mutex_lock(&data->frame_lock);
+
+    rate = ACCESS_ONCE(data->frame_rate);
+    now = ktime_get();
+    slot = now;
+    if (rate && data->frames)
+    {
+        slot = ktime_add_ns(data->frame_last, NSEC_PER_SEC / rate);
+        late_ns = ktime_to_ns(ktime_sub(now, slot));
+        if (late_ns < 0)
+        {
+            __set_current_state(TASK_INTERRUPTIBLE);
+            if (schedule_hrtimeout(&slot, HRTIMER_MODE_ABS))
+            {
+                ret = -EINTR;
+                goto out;
+            }
+        }
+        else if (late_ns < NSEC_PER_SEC / rate)
+            data->frames_missed++;
+        else
+            slot = now;
+    }
+
+    /* Under the owner policy a frame doesn't touch claimed leds */
+    chip_lock(data);
+    __chip_frame_begin(data);
+    memcpy(frame, data->frame_back, sizeof(frame));
+    if (data->led_policy == CHIP_LED_OWNER)
+        frame[0] = (frame[0] & ~data->led_owned) |
+            (data->led_value & data->led_owned);
+    ret = __chip_write_block(data, REG_CHIP_PORTA_LOUT, frame,
+        sizeof(frame));
+    data->frame_open = false;
+    chip_unlock(data);
+
+    if (ret == 0)
+    {
+        /* Keep the slots on the grid unless we fell behind */
+        data->frame_last = late_ns > 0 ? now : slot;
+        data->frames++;
+    }
+
+out:
+    mutex_unlock(&data->frame_lock);
+    return ret;
+}
+
+/* Bit angle modulation. Each period is divided in 255 units and bit
+ * plane k of the brightness values is shown for 2^k of them, so 256
+ * brightness levels cost 8 led writes per period instead of 255.
+ * The thread sleeps on an hrtimer between planes. A plane the bus
+ * can't fit in its time (the short ones, on a slow bus or at high
+ * rates) counts as an overrun and the next one starts right away.
+ */
+static void __chip_bam_update_planes(struct chip_data *data)
+{
+    int plane, led;
+
+    for (plane = 0; plane < 8; plane++)
+    {
+        data->bam_planes[plane] = 0;
+        for (led = 0; led < 8; led++)
+            if (data->brightness[led] & (1 << plane))
+                data->bam_planes[plane] |= 1 << led;
+    }
+}
+
+static int chip_bam_thread(void *arg)
+{
+    struct chip_data *data = arg;
+    u64 unit_ns = div_u64(NSEC_PER_SEC, data->bam_rate * 255);
+    ktime_t deadline = ktime_get();
+    int plane;
+    u8 value;
+
+    while (!kthread_should_stop())
+    {
+        for (plane = 0; plane < 8; plane++)
+        {
+            /* Like any other writer, leave the claimed leds alone */
+            chip_lock(data);
+            value = data->bam_planes[plane];
+            __chip_led_bits(data, 0xFF, value);
+            chip_unlock(data);
+
+            deadline = ktime_add_ns(deadline, unit_ns << plane);
+            if (ktime_to_ns(ktime_sub(deadline, ktime_get())) < 0)
+            {
+                data->bam_overruns++;
+                deadline = ktime_get();
+                continue;
+            }
+
+            set_current_state(TASK_INTERRUPTIBLE);
+            if (kthread_should_stop())
+            {
+                __set_current_state(TASK_RUNNING);
+                break;
+            }
+            schedule_hrtimeout(&deadline, HRTIMER_MODE_ABS);
+        }
+    }
+
+    return 0;
+}
+
+/* Start or stop (rate 0) the BAM engine. Once stopped, the leds with
+ * a brightness of 128 or more stay on.
+ */
+static int chip_bam_set_rate(struct chip_data *data, unsigned int rate)
+{
+    struct task_struct *thread;
+    bool was_running = false;
+    int ret = 0;
+
+    mutex_lock(&data->bam_lock);
+
+    if (data->bam_thread)
+    {
+        kthread_stop(data->bam_thread);
+        data->bam_thread = NULL;
+        was_running = true;
+    }
+
+    data->bam_rate = rate;
+    if (rate)
+    {
+        thread = kthread_run(chip_bam_thread, data, "chip_i2c_bam");
+        if (IS_ERR(thread))
+        {
+            ret = PTR_ERR(thread);
+            data->bam_rate = 0;
+        }
+        else
+            data->bam_thread = thread;
+    }
+
+    if (was_running && !data->bam_thread)
+    {
+        chip_lock(data);
+        __chip_led_bits(data, 0xFF, data->bam_planes[7]);
+        chip_unlock(data);
+    }
+
+    mutex_unlock(&data->bam_lock);
+    return ret;
+}
+
+/* Led class devices. Triggers can set the brightness at high rates
+ * and from atomic context, so brightness_set only records the change
+ * and the changes of all 8 leds are flushed by leds_work in a single
+ * led write every led_flush_ms. While the BAM engine runs, the led
+ * class brightness becomes the led's BAM brightness, otherwise any
+ * brightness other than 0 turns the led on.
+ */
+static void chip_leds_work(struct work_struct *work)
+{
+    struct chip_data *data = container_of(work, struct chip_data,
+        leds_work.work);
+    u8 pending[8], dirty, on = 0;
+    int i;
+
+    spin_lock_irq(&data->leds_lock);
+    dirty = data->leds_dirty;
+    memcpy(pending, data->leds_pending, sizeof(pending));
+    data->leds_dirty = 0;
+    spin_unlock_irq(&data->leds_lock);
+
+    if (!dirty)
+        return;
+
+    chip_lock(data);
+    for (i = 0; i < 8; i++)
+    {
+        if (dirty & (1 << i))
+            data->brightness[i] = pending[i];
+        if (data->brightness[i])
+            on |= 1 << i;
+    }
+    __chip_bam_update_planes(data);
+
+    /* The led class is just another writer, claimed leds stay */
+    if (!ACCESS_ONCE(data->bam_rate))
+        __chip_led_bits(data, dirty, on);
+    chip_unlock(data);
+}
+
+#if IS_ENABLED(CONFIG_LEDS_CLASS)
+static void chip_led_brightness_set(struct led_classdev *cdev,
+    enum led_brightness value)
+{
+    struct chip_led *led = container_of(cdev, struct chip_led, cdev);
+    struct chip_data *data = led->data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&data->leds_lock, flags);
+    if (data->leds_dirty & (1 << led->bit))
+        chip_count(CHIP_CNT_COALESCED_WRITES, 1);
+    data->leds_pending[led->bit] = value;
+    data->leds_dirty |= 1 << led->bit;
+    spin_unlock_irqrestore(&data->leds_lock, flags);
+
+    schedule_delayed_work(&data->leds_work,
+        msecs_to_jiffies(ACCESS_ONCE(data->led_flush_ms)));
+}
+
+static enum led_brightness chip_led_brightness_get(struct led_classdev *cdev)
+{
+    struct chip_led *led = container_of(cdev, struct chip_led, cdev);
+
+    return led->data->brightness[led->bit];
+}
+
+static void chip_leds_unregister(struct chip_data *data, int count)
+{
+    while (count--)
+        led_classdev_unregister(&data->leds[count].cdev);
+    cancel_delayed_work_sync(&data->leds_work);
+}
+
+static int chip_leds_register(struct chip_data *data)
+{
+    struct device *dev = data->dev;
+    struct chip_led *led;
+    int i, ret;
+
+    for (i = 0; i < 8; i++)
+    {
+        led = &data->leds[i];
+        led->data = data;
+        led->bit = i;
+        snprintf(led->name, sizeof(led->name), "chip_i2c-%s:led%d",
+            dev_name(dev), i);
+        led->cdev.name = led->name;
+        led->cdev.max_brightness = LED_FULL;
+        led->cdev.brightness_set = chip_led_brightness_set;
+        led->cdev.brightness_get = chip_led_brightness_get;
+
+        ret = led_classdev_register(dev, &led->cdev);
+        if (ret)
+        {
+            chip_leds_unregister(data, i);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+#else
+static int chip_leds_register(struct chip_data *data) { return 0; }
+static void chip_leds_unregister(struct chip_data *data, int count) { }
+#endif /* CONFIG_LEDS_CLASS */
+
+/* The following functions are used by this device drivers
+* to provide a char device functionality.
+*/
+static int chip_i2c_open(struct inode * inode, struct file *fp)
+{
+   struct chip_file * cf;
+
+   printk("%s: Attempt to open our device\n", __FUNCTION__);
+
+   /* Any number of processes can have the device open,
+    * each gets its own context. Writers write the leds,
+    * readers get the switch events.
+    */
+   cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+   if (cf == NULL)
+       return -ENOMEM;
+
+   cf->reader = (fp->f_mode & FMODE_READ) != 0;
+   cf->sub_mask = 0xFF;
+   cf->sub_edges = CHIP_I2C_SUB_RISING | CHIP_I2C_SUB_FALLING;
+   init_waitqueue_head(&cf->wait);
+   spin_lock_init(&cf->lock);
+   fp->private_data = cf;
+
+   /* We olso need to check if the chip driver (client)
+    * is already loaded, otherwise write/read to/from
+    * i2c device will fail. The file keeps a reference
+    * to the chip's data until it is closed.
+    */
+   chip_files_lock();
+   if (chip_i2c_chip == NULL)
+   {
+       chip_files_unlock();
+       kfree(cf);
+       return -ENODEV;
+   }
+   cf->data = chip_i2c_chip;
+   kref_get(&cf->data->kref);
+   list_add_tail(&cf->list, &chip_files);
+   chip_files_unlock();
+
+   return 0;
+}
+
+static int chip_i2c_close(struct inode * inode, struct file * fp)
+{
+   struct chip_file * cf = fp->private_data;
+
+   printk("%s: Freeing /dev resource\n", __FUNCTION__);
+
+   /* Let the fair worker finish our pending writes */
+   if (ACCESS_ONCE(cf->fair_count))
+       flush_work(&cf->data->fair_work);
+
+   chip_lock(cf->data);
+   chip_files_lock();
+   cf->data->led_owned &= ~cf->owned;
+   list_del(&cf->list);
+   chip_files_unlock();
+   chip_unlock(cf->data);
+
+   if (cf->ring)
+       chip_ring_free(cf->ring);
+   chip_data_put(cf->data);
+   kfree(cf);
+
+   return 0;
+}
+
+/* Our file op read function, returns the switch events
+ * (struct chip_i2c_event) queued for this file.
+ */
+static ssize_t chip_fop_read(struct file * fp, char __user * buf,
+        size_t count, loff_t * offset)
+{
+    struct chip_file * cf = fp->private_data;
+    struct chip_i2c_event event;
+    size_t done = 0;
+    int ret;
+
+    if (count < sizeof(event))
+        return -EINVAL;
+
+    for (;;)
+    {
+        while (done + sizeof(event) <= count &&
+            chip_file_pop_event(cf, &event))
+        {
+            if (copy_to_user(buf + done, &event, sizeof(event)))
+                return done ? done : -EFAULT;
+            done += sizeof(event);
+        }
+
+        if (done)
+            return done;
+        if (ACCESS_ONCE(cf->data->dead))
+            return -ENODEV;
+        if (fp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(cf->wait, chip_file_has_events(cf) ||
+            ACCESS_ONCE(cf->data->dead));
+        if (ret)
+            return ret;
+    }
+}
+
+/* Our file op write function, every byte written is
+* written to the leds under the client's led policy.
+*/
+static ssize_t chip_fop_write(struct file * fp, const char __user * buf,
+        size_t count, loff_t * offset)
+{
+    struct chip_file * cf = fp->private_data;
+    struct chip_data * data = cf->data;
+    ssize_t numwrite = 0;
+    u8 * tmp;
+    int x, ret = 0;
+
+    if (ACCESS_ONCE(data->dead))
+        return -ENODEV;
+
+    /* We'll limit the number of bytes written out */
+    if (count > 512)
+        count = 512;
+
+    tmp = memdup_user(buf, count);
+    if (IS_ERR(tmp))
+        return PTR_ERR(tmp);
+
+    printk("%s: Write operation with [%zu] bytes\n", __FUNCTION__, count);
+    if (data->led_policy == CHIP_LED_FAIR)
+    {
+        numwrite = chip_fair_write(cf, tmp, count,
+            fp->f_flags & O_NONBLOCK);
+    }
+    else
+    {
+        /* One byte per lock hold, a long write mustn't keep the
+         * switch path and the other writers waiting.
+         */
+        for (x = 0; x < count; x++)
+        {
+            chip_lock(data);
+            ret = __chip_file_led_write(cf, tmp[x]);
+            chip_unlock(data);
+            if (ret == 0)
+                numwrite++;
+            else if (ret == -EPERM)
+                break;
+        }
+
+        /* Nothing was written, tell why */
+        if (numwrite == 0 && ret < 0)
+            numwrite = ret;
+    }
+
+    kfree(tmp);
+    return numwrite;
+}
+
+static unsigned int chip_i2c_poll(struct file * fp, poll_table * wait)
+{
+    struct chip_file * cf = fp->private_data;
+    unsigned int mask = 0;
+
+    poll_wait(fp, &cf->wait, wait);
+
+    if (ACCESS_ONCE(cf->data->dead))
+        mask |= POLLERR | POLLHUP;
+    if (chip_file_has_events(cf))
+        mask |= POLLIN | POLLRDNORM;
+    if (cf->data->led_policy != CHIP_LED_FAIR || chip_fair_space(cf))
+        mask |= POLLOUT | POLLWRNORM;
+
+    return mask;
+}
+
+/* Install a new reflex map and apply it to the current switch state
+ * right away. Caller holds update_lock, so that the sysfs files can
+ * change a single field of the map without racing each other.
+ */
+static int __chip_reflex_set(struct chip_data *data,
+    const struct chip_i2c_reflex *reflex)
+{
+    if (reflex->mode > CHIP_I2C_REFLEX_LUT)
+        return -EINVAL;
+
+    data->reflex = *reflex;
+    if (data->switch_value >= 0)
+        chip_reflex_run(data, data->switch_value);
+
+    return 0;
+}
+
+static int chip_reflex_set(struct chip_data *data,
+    const struct chip_i2c_reflex *reflex)
+{
+    int ret;
+
+    chip_lock(data);
+    ret = __chip_reflex_set(data, reflex);
+    chip_unlock(data);
+
+    return ret;
+}
+
+/* Our ioctl handler, see chip_i2c.h for the commands. */
+static long chip_i2c_ioctl(struct file * fp, unsigned int cmd,
+        unsigned long arg)
+{
+    void __user * argp = (void __user *) arg;
+    struct chip_i2c_switch_read rd;
+    struct chip_i2c_reflex reflex;
+    struct chip_i2c_irq_mode irq_mode;
+    struct chip_i2c_subscription sub;
+    struct chip_i2c_ring_setup setup;
+    struct chip_i2c_file_stats stats;
+    struct chip_i2c_leds leds;
+    struct chip_i2c_frame frame;
+    struct chip_file * cf = fp->private_data;
+    struct chip_data * data = cf->data;
+    struct chip_ring * ring;
+    int val;
+
+    if (ACCESS_ONCE(data->dead))
+        return -ENODEV;
+
+    switch (cmd)
+    {
+    case CHIP_I2C_IOC_READ_SWITCH:
+        if (copy_from_user(&rd, argp, sizeof(rd)))
+            return -EFAULT;
+
+        val = chip_read_switch(data, rd.deadline_ms, &rd.flags);
+        if (val < 0)
+            return val;
+
+        rd.value = val;
+        if (copy_to_user(argp, &rd, sizeof(rd)))
+            return -EFAULT;
+        return 0;
+
+    case CHIP_I2C_IOC_SET_REFLEX:
+        if (copy_from_user(&reflex, argp, sizeof(reflex)))
+            return -EFAULT;
+        return chip_reflex_set(data, &reflex);
+
+    case CHIP_I2C_IOC_GET_REFLEX:
+        chip_lock(data);
+        reflex = data->reflex;
+        chip_unlock(data);
+        if (copy_to_user(argp, &reflex, sizeof(reflex)))
+            return -EFAULT;
+        return 0;
+
+    case CHIP_I2C_IOC_SET_IRQ_MODE:
+        if (copy_from_user(&irq_mode, argp, sizeof(irq_mode)))
+            return -EFAULT;
+        return chip_irq_mode_set(data, &irq_mode);
+
+    case CHIP_I2C_IOC_GET_IRQ_MODE:
+        chip_lock(data);
+        irq_mode = data->irq_mode;
+        chip_unlock(data);
+        if (copy_to_user(argp, &irq_mode, sizeof(irq_mode)))
+            return -EFAULT;
+        return 0;
+
+    case CHIP_I2C_IOC_RING_SETUP:
+        if (!(fp->f_mode & FMODE_WRITE))
+            return -EBADF;
+        if (copy_from_user(&setup, argp, sizeof(setup)))
+            return -EFAULT;
+        val = chip_ring_setup(cf, &setup);
+        if (val < 0)
+            return val;
+        if (copy_to_user(argp, &setup, sizeof(setup)))
+            return -EFAULT;
+        return 0;
+
+    case CHIP_I2C_IOC_RING_ENTER:
+        ring = ACCESS_ONCE(cf->ring);
+        if (ring == NULL)
+            return -EINVAL;
+        /* Don't let the unsigned int truncate a bogus argument */
+        if (arg > UINT_MAX)
+            return -EINVAL;
+        return chip_ring_enter(ring, arg);
+
+    case CHIP_I2C_IOC_CLAIM_LEDS:
+        if (!(fp->f_mode & FMODE_WRITE))
+            return -EBADF;
+        if (arg > 0xFF)
+            return -EINVAL;
+        return chip_file_claim(cf, arg);
+
+    case CHIP_I2C_IOC_SET_LEDS:
+        if (!(fp->f_mode & FMODE_WRITE))
+            return -EBADF;
+        if (copy_from_user(&leds, argp, sizeof(leds)))
+            return -EFAULT;
+        chip_lock(data);
+        val = __chip_file_led_bits(cf, leds.mask, leds.value);
+        chip_unlock(data);
+        return val;
+
+    case CHIP_I2C_IOC_FRAME_SET:
+        if (!(fp->f_mode & FMODE_WRITE))
+            return -EBADF;
+        if (copy_from_user(&frame, argp, sizeof(frame)))
+            return -EFAULT;
+        chip_lock(data);
+        __chip_frame_begin(data);
+        for (val = 0; val < ARRAY_SIZE(frame.olat); val++)
+            data->frame_back[val] = (data->frame_back[val] & ~frame.mask[val]) |
+                (frame.olat[val] & frame.mask[val]);
+        chip_unlock(data);
+        return 0;
+
+    case CHIP_I2C_IOC_FRAME_COMMIT:
+        if (!(fp->f_mode & FMODE_WRITE))
+            return -EBADF;
+        return chip_frame_commit(data);
+
+    case CHIP_I2C_IOC_SUBSCRIBE:
+        if (copy_from_user(&sub, argp, sizeof(sub)))
+            return -EFAULT;
+        if (sub.edges & ~(CHIP_I2C_SUB_RISING | CHIP_I2C_SUB_FALLING))
+            return -EINVAL;
+        spin_lock(&cf->lock);
+        cf->sub_mask = sub.mask;
+        cf->sub_edges = sub.edges;
+        spin_unlock(&cf->lock);
+        return 0;
+
+    case CHIP_I2C_IOC_FILE_STATS:
+        chip_lock(data);
+        spin_lock(&cf->lock);
+        stats = cf->stats;
+        spin_unlock(&cf->lock);
+        chip_unlock(data);
+        if (copy_to_user(argp, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* Our file operations table, thiw will used by the 
+ * initializzation code (probe) to create a character
+ * device on /dev. 
+ */
+static const struct file_operations chip_i2c_fops = {
+    .owner = THIS_MODULE,
+    .llseek = no_llseek,
+    .read = chip_fop_read,
+    .write = chip_fop_write,
+    .poll = chip_i2c_poll,
+    .unlocked_ioctl = chip_i2c_ioctl,
+    .mmap = chip_i2c_mmap,
+    .compat_ioctl = chip_i2c_ioctl,
+    .open = chip_i2c_open,
+    .release = chip_i2c_close
+};
+
+
+/* Our driver attributes/variables are currently exported via sysfs. 
+ * For this driver, we export two attributes - chip_led and chip_switch
+ * to correspond to MCP23017's PORTA (led) and PORTB(dip switches).
+ *
+ * The sysfs filesystem is a convenient way to examine these attributes
+ * in kernel space from user space. They also provide a mechanism for 
+ * setting data form user space to kernel space. 
+ **/
+static ssize_t set_chip_led(struct device *dev, 
+    struct device_attribute * devattr,
+    const char * buf, 
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    int value, err;
+
+    dev_dbg(dev, "%s\n", __FUNCTION__);
+
+    err = kstrtoint(buf, 10, &value);
+    if (err < 0)
+        return err;
+
+    dev_dbg(dev, "%s: write to %s with val %d\n", 
+        __FUNCTION__,
+        data->bus.ops->name,
+        value);
+
+    /* Goes through the led policy, like the writes of open files */
+    chip_lock(data);
+    err = __chip_led_bits(data, 0xFF, value);
+    chip_unlock(data);
+
+    return err < 0 ? err : count;
+}
+
+static ssize_t get_chip_switch(struct device *dev, 
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    int value = 0;
+    u8 flags;
+
+    dev_dbg(dev, "%s\n", __FUNCTION__);
+
+    value = chip_read_switch(data, data->read_deadline_ms, &flags);
+    if (value < 0)
+        return value;
+
+    dev_info(dev,"%s: read returned with %d!\n", 
+        __FUNCTION__, 
+        value);
+    // Copy the result back to buf, flag it if we
+    // could not reach the bus before the deadline
+    if (flags & CHIP_I2C_SWITCH_STALE)
+        return sprintf(buf, "%d stale\n", value);
+    return sprintf(buf, "%d\n", value);
+}
+
+/* The deadline (in ms) for reading chip_switch, 0 means
+ * block until the bus is available.
+ */
+static ssize_t get_chip_switch_deadline(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->read_deadline_ms);
+}
+
+static ssize_t set_chip_switch_deadline(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+
+    data->read_deadline_ms = value;
+
+    return count;
+}
+
+/* The max age (in ms) of a cached chip_switch value. Reads
+ * within this window of the last bus read are served from the
+ * cache, 0 disables caching.
+ */
+static ssize_t get_chip_switch_max_age(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->switch_max_age_ms);
+}
+
+static ssize_t set_chip_switch_max_age(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+
+    data->switch_max_age_ms = value;
+
+    return count;
+}
+
+/* The switch sampling period in ms, 0 turns the sampler off */
+static ssize_t get_chip_sample_interval(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->sample_ms);
+}
+
+static ssize_t set_chip_sample_interval(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+
+    data->sample_ms = value;
+    if (value)
+        mod_delayed_work(system_wq, &data->sample_work, 0);
+
+    return count;
+}
+
+/* The reflex map mode, one of "off", "copy", "invert" or "lut".
+ * The lookup table itself can only be set through ioctl.
+ */
+static const char * const chip_reflex_modes[] = {
+    [CHIP_I2C_REFLEX_OFF]       = "off",
+    [CHIP_I2C_REFLEX_COPY]      = "copy",
+    [CHIP_I2C_REFLEX_INVERT]    = "invert",
+    [CHIP_I2C_REFLEX_LUT]       = "lut",
+};
+
+static ssize_t get_chip_reflex_mode(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(chip_reflex_modes); i++)
+        len += sprintf(buf + len, i == data->reflex.mode ? "[%s] " : "%s ",
+            chip_reflex_modes[i]);
+    buf[len - 1] = '\n';
+
+    return len;
+}
+
+static ssize_t set_chip_reflex_mode(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    struct chip_i2c_reflex reflex;
+    int i, err;
+
+    for (i = 0; i < ARRAY_SIZE(chip_reflex_modes); i++)
+        if (sysfs_streq(buf, chip_reflex_modes[i]))
+            break;
+    if (i == ARRAY_SIZE(chip_reflex_modes))
+        return -EINVAL;
+
+    chip_lock(data);
+    reflex = data->reflex;
+    reflex.mode = i;
+    err = __chip_reflex_set(data, &reflex);
+    chip_unlock(data);
+
+    return err ? err : count;
+}
+
+/* The led bits driven by the reflex map */
+static ssize_t get_chip_reflex_mask(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "0x%02x\n", data->reflex.mask);
+}
+
+static ssize_t set_chip_reflex_mask(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    struct chip_i2c_reflex reflex;
+    u8 value;
+    int err;
+
+    err = kstrtou8(buf, 0, &value);
+    if (err < 0)
+        return err;
+
+    chip_lock(data);
+    reflex = data->reflex;
+    reflex.mask = value;
+    err = __chip_reflex_set(data, &reflex);
+    chip_unlock(data);
+
+    return err ? err : count;
+}
+
+/* The bus clock frequency (in Hz) used to estimate the wire time of
+ * our transfers.
+ */
+static ssize_t get_chip_bus_hz(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->bus_hz);
+}
+
+static ssize_t set_chip_bus_hz(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+    if (value == 0)
+        return -EINVAL;
+
+    chip_lock(data);
+    chip_set_bus_hz(data, value);
+    chip_unlock(data);
+
+    return count;
+}
+
+/* Estimated bus occupancy (in percent) over the last 1, 10 and 60
+ * seconds, of this client and of all our clients on its adapter.
+ */
+static ssize_t get_chip_bus_occupancy(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return chip_occupancy_show(&data->occ, buf);
+}
+
+static ssize_t get_chip_adapter_occupancy(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return chip_occupancy_show(&data->adapter_stats->occ, buf);
+}
+
+/* How long (in ms) switch events are held back to be batched into
+ * one netlink message.
+ */
+static ssize_t get_chip_event_batch(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->event_batch_ms);
+}
+
+static ssize_t set_chip_event_batch(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+
+    data->event_batch_ms = value;
+
+    return count;
+}
+
+/* The minimum time in ms between two led framebuffer flushes */
+static ssize_t get_chip_fb_delay(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->fb_delay_ms);
+}
+
+static ssize_t set_chip_fb_delay(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+    if (value > 1000)
+        return -EINVAL;
+
+    data->fb_delay_ms = value;
+
+    return count;
+}
+
+/* Frame commit pacing in frames per second, 0 turns it off */
+static ssize_t get_chip_frame_rate(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->frame_rate);
+}
+
+static ssize_t set_chip_frame_rate(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+    if (value > 1000)
+        return -EINVAL;
+
+    data->frame_rate = value;
+
+    return count;
+}
+
+/* Committed and missed frames, read only */
+static ssize_t get_chip_frames(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    u64 frames, missed;
+
+    mutex_lock(&data->frame_lock);
+    frames = data->frames;
+    missed = data->frames_missed;
+    mutex_unlock(&data->frame_lock);
+
+    return sprintf(buf, "%llu %llu\n", frames, missed);
+}
+
+/* The brightness of the 8 leds (0 to 255), used while the BAM
+ * engine runs (see chip_bam_rate).
+ */
+static ssize_t get_chip_led_brightness(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    u8 *b = data->brightness;
+
+    return sprintf(buf, "%u %u %u %u %u %u %u %u\n",
+        b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
+}
+
+static ssize_t set_chip_led_brightness(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int b[8];
+    int i;
+
+    if (sscanf(buf, "%u %u %u %u %u %u %u %u", &b[0], &b[1], &b[2],
+            &b[3], &b[4], &b[5], &b[6], &b[7]) != 8)
+        return -EINVAL;
+    for (i = 0; i < 8; i++)
+        if (b[i] > 255)
+            return -EINVAL;
+
+    chip_lock(data);
+    for (i = 0; i < 8; i++)
+        data->brightness[i] = b[i];
+    __chip_bam_update_planes(data);
+    chip_unlock(data);
+
+    return count;
+}
+
+/* The edge counters, one line per switch with the rising and
+ * falling edges, and the frequencies (in Hz) over the last gate.
+ * Edges are only counted with the interrupt.
+ */
+static ssize_t get_chip_edge_counts(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    int i;
+
+    chip_lock(data);
+    for (i = 0; i < 8; i++)
+        len += sprintf(buf + len, "%d %llu %llu\n", i,
+            data->edge_rising[i], data->edge_falling[i]);
+    chip_unlock(data);
+
+    return len;
+}
+
+static ssize_t get_chip_edge_freq(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    u32 freq;
+    int i;
+
+    chip_lock(data);
+    for (i = 0; i < 8; i++)
+    {
+        freq = data->edge_freq_mhz[i];
+        len += sprintf(buf + len, "%u.%03u ", freq / 1000, freq % 1000);
+    }
+    chip_unlock(data);
+    buf[len - 1] = '\n';
+
+    return len;
+}
+
+/* The interrupt mode of each switch, switch 0 first: "any" (any
+ * change), "off", or "def0"/"def1" (while the switch differs from
+ * 0 or 1, filtered by the chip).
+ */
+static ssize_t get_chip_irq_mode(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    struct chip_i2c_irq_mode mode;
+    ssize_t len = 0;
+    int i;
+
+    chip_lock(data);
+    mode = data->irq_mode;
+    chip_unlock(data);
+
+    for (i = 0; i < 8; i++)
+    {
+        if (!(mode.enable & (1 << i)))
+            len += sprintf(buf + len, "off ");
+        else if (!(mode.compare & (1 << i)))
+            len += sprintf(buf + len, "any ");
+        else
+            len += sprintf(buf + len, "def%d ", !!(mode.defval & (1 << i)));
+    }
+    buf[len - 1] = '\n';
+
+    return len;
+}
+
+static ssize_t set_chip_irq_mode(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    struct chip_i2c_irq_mode mode = { 0 };
+    char token[8];
+    int i, n, err;
+
+    for (i = 0; i < 8; i++)
+    {
+        if (sscanf(buf, " %7s%n", token, &n) != 1)
+            return -EINVAL;
+        buf += n;
+
+        if (!strcmp(token, "off"))
+            continue;
+        mode.enable |= 1 << i;
+        if (!strcmp(token, "any"))
+            continue;
+        mode.compare |= 1 << i;
+        if (!strcmp(token, "def1"))
+            mode.defval |= 1 << i;
+        else if (strcmp(token, "def0"))
+            return -EINVAL;
+    }
+
+    err = chip_irq_mode_set(data, &mode);
+    if (err < 0)
+        return err;
+
+    return count;
+}
+
+/* The interrupt storm limit in interrupts per second of a single
+ * switch, 0 turns storm protection off. chip_storm shows the
+ * switches currently sampled because of a storm.
+ */
+static ssize_t get_chip_storm_rate(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->storm_rate);
+}
+
+static ssize_t set_chip_storm_rate(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+    if (value > 100000)
+        return -EINVAL;
+
+    data->storm_rate = value;
+
+    return count;
+}
+
+static ssize_t get_chip_storm(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "0x%02x\n", ACCESS_ONCE(data->storm_bits));
+}
+
+/* Input capture on (1) or off (0), needs the interrupt */
+static ssize_t get_chip_capture(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", data->capture);
+}
+
+static ssize_t set_chip_capture(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    bool value;
+    int err;
+
+    err = strtobool(buf, &value);
+    if (err < 0)
+        return err;
+    if (value && data->capture_mem == NULL)
+        return -ENODEV;
+
+    chip_lock(data);
+    data->capture = value;
+    chip_unlock(data);
+
+    return count;
+}
+
+/* The frequency gate time in ms, 0 turns the frequencies off */
+static ssize_t get_chip_edge_gate(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->edge_gate_ms);
+}
+
+static ssize_t set_chip_edge_gate(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+    if (value > 60000)
+        return -EINVAL;
+
+    data->edge_gate_ms = 0;
+    cancel_delayed_work_sync(&data->edge_work);
+    data->edge_gate_ms = value;
+    if (value)
+        schedule_delayed_work(&data->edge_work, msecs_to_jiffies(value));
+
+    return count;
+}
+
+/* How long in ms led class changes are collected before they are
+ * written to the leds.
+ */
+static ssize_t get_chip_led_flush(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->led_flush_ms);
+}
+
+static ssize_t set_chip_led_flush(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+    if (value > 1000)
+        return -EINVAL;
+
+    data->led_flush_ms = value;
+
+    return count;
+}
+
+/* BAM periods per second, 0 stops the engine */
+static ssize_t get_chip_bam_rate(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->bam_rate);
+}
+
+static ssize_t set_chip_bam_rate(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+    if (value > 1000)
+        return -EINVAL;
+
+    err = chip_bam_set_rate(data, value);
+    if (err < 0)
+        return err;
+
+    return count;
+}
+
+/* The netlink stats snapshot period in ms, 0 turns them off */
+static ssize_t get_chip_stats_interval(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", data->stats_interval_ms);
+}
+
+static ssize_t set_chip_stats_interval(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    unsigned int value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err < 0)
+        return err;
+    if (value && !chip_genl_registered)
+        return -ENODEV;
+
+    data->stats_interval_ms = value;
+    if (value)
+        mod_delayed_work(system_wq, &data->stats_work,
+            msecs_to_jiffies(value));
+
+    return count;
+}
+
+/* The arbitration policy between open files writing the leds,
+ * one of "last-writer", "owner" or "fair".
+ */
+static const char * const chip_led_policies[] = {
+    [CHIP_LED_LAST_WRITER]  = "last-writer",
+    [CHIP_LED_OWNER]        = "owner",
+    [CHIP_LED_FAIR]         = "fair",
+};
+
+static ssize_t get_chip_led_policy(struct device *dev,
+    struct device_attribute *dev_attr,
+    char * buf)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(chip_led_policies); i++)
+        len += sprintf(buf + len, i == data->led_policy ? "[%s] " : "%s ",
+            chip_led_policies[i]);
+    buf[len - 1] = '\n';
+
+    return len;
+}
+
+static ssize_t set_chip_led_policy(struct device *dev,
+    struct device_attribute * devattr,
+    const char * buf,
+    size_t count)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(chip_led_policies); i++)
+        if (sysfs_streq(buf, chip_led_policies[i]))
+            break;
+    if (i == ARRAY_SIZE(chip_led_policies))
+        return -EINVAL;
+
+    chip_lock(data);
+    data->led_policy = i;
+    chip_unlock(data);
+
+    return count;
+}
+
+/* chip led is write only */
+static DEVICE_ATTR(chip_led, S_IWUGO, NULL, set_chip_led);
+/* chip switch is read only */
+static DEVICE_ATTR(chip_switch, S_IRUGO, get_chip_switch, NULL);
+static DEVICE_ATTR(chip_switch_deadline, S_IRUGO | S_IWUSR,
+    get_chip_switch_deadline, set_chip_switch_deadline);
+static DEVICE_ATTR(chip_switch_max_age, S_IRUGO | S_IWUSR,
+    get_chip_switch_max_age, set_chip_switch_max_age);
+static DEVICE_ATTR(chip_sample_interval, S_IRUGO | S_IWUSR,
+    get_chip_sample_interval, set_chip_sample_interval);
+static DEVICE_ATTR(chip_reflex_mode, S_IRUGO | S_IWUSR,
+    get_chip_reflex_mode, set_chip_reflex_mode);
+static DEVICE_ATTR(chip_reflex_mask, S_IRUGO | S_IWUSR,
+    get_chip_reflex_mask, set_chip_reflex_mask);
+static DEVICE_ATTR(chip_bus_hz, S_IRUGO | S_IWUSR,
+    get_chip_bus_hz, set_chip_bus_hz);
+static DEVICE_ATTR(chip_bus_occupancy, S_IRUGO,
+    get_chip_bus_occupancy, NULL);
+static DEVICE_ATTR(chip_adapter_occupancy, S_IRUGO,
+    get_chip_adapter_occupancy, NULL);
+static DEVICE_ATTR(chip_event_batch, S_IRUGO | S_IWUSR,
+    get_chip_event_batch, set_chip_event_batch);
+static DEVICE_ATTR(chip_stats_interval, S_IRUGO | S_IWUSR,
+    get_chip_stats_interval, set_chip_stats_interval);
+static DEVICE_ATTR(chip_led_policy, S_IRUGO | S_IWUSR,
+    get_chip_led_policy, set_chip_led_policy);
+static DEVICE_ATTR(chip_fb_delay, S_IRUGO | S_IWUSR,
+    get_chip_fb_delay, set_chip_fb_delay);
+static DEVICE_ATTR(chip_frame_rate, S_IRUGO | S_IWUSR,
+    get_chip_frame_rate, set_chip_frame_rate);
+static DEVICE_ATTR(chip_frames, S_IRUGO, get_chip_frames, NULL);
+static DEVICE_ATTR(chip_led_brightness, S_IRUGO | S_IWUSR,
+    get_chip_led_brightness, set_chip_led_brightness);
+static DEVICE_ATTR(chip_bam_rate, S_IRUGO | S_IWUSR,
+    get_chip_bam_rate, set_chip_bam_rate);
+static DEVICE_ATTR(chip_led_flush, S_IRUGO | S_IWUSR,
+    get_chip_led_flush, set_chip_led_flush);
+static DEVICE_ATTR(chip_edge_counts, S_IRUGO, get_chip_edge_counts, NULL);
+static DEVICE_ATTR(chip_edge_freq, S_IRUGO, get_chip_edge_freq, NULL);
+static DEVICE_ATTR(chip_edge_gate, S_IRUGO | S_IWUSR,
+    get_chip_edge_gate, set_chip_edge_gate);
+static DEVICE_ATTR(chip_capture, S_IRUGO | S_IWUSR,
+    get_chip_capture, set_chip_capture);
+static DEVICE_ATTR(chip_irq_mode, S_IRUGO | S_IWUSR,
+    get_chip_irq_mode, set_chip_irq_mode);
+static DEVICE_ATTR(chip_storm_rate, S_IRUGO | S_IWUSR,
+    get_chip_storm_rate, set_chip_storm_rate);
+static DEVICE_ATTR(chip_storm, S_IRUGO, get_chip_storm, NULL);
+
+static struct attribute * chip_i2c_attrs[] = {
+    &dev_attr_chip_led.attr,
+    &dev_attr_chip_switch.attr,
+    &dev_attr_chip_switch_deadline.attr,
+    &dev_attr_chip_switch_max_age.attr,
+    &dev_attr_chip_sample_interval.attr,
+    &dev_attr_chip_reflex_mode.attr,
+    &dev_attr_chip_reflex_mask.attr,
+    &dev_attr_chip_bus_hz.attr,
+    &dev_attr_chip_bus_occupancy.attr,
+    &dev_attr_chip_adapter_occupancy.attr,
+    &dev_attr_chip_event_batch.attr,
+    &dev_attr_chip_stats_interval.attr,
+    &dev_attr_chip_led_policy.attr,
+    &dev_attr_chip_fb_delay.attr,
+    &dev_attr_chip_frame_rate.attr,
+    &dev_attr_chip_frames.attr,
+    &dev_attr_chip_led_brightness.attr,
+    &dev_attr_chip_bam_rate.attr,
+    &dev_attr_chip_led_flush.attr,
+    &dev_attr_chip_edge_counts.attr,
+    &dev_attr_chip_edge_freq.attr,
+    &dev_attr_chip_edge_gate.attr,
+    &dev_attr_chip_capture.attr,
+    &dev_attr_chip_irq_mode.attr,
+    &dev_attr_chip_storm_rate.attr,
+    &dev_attr_chip_storm.attr,
+    NULL
+};
+
+static const struct attribute_group chip_i2c_attr_group = {
+    .attrs = chip_i2c_attrs,
+};
+
+
+/* The lock statistics in debugfs */
+static int chip_lock_stats_show(struct seq_file *m, void *v)
+{
+    struct chip_lock_stats *stats = m->private;
+    int i;
+
+    spin_lock(&stats->lock);
+    seq_printf(m, "acquired:      %llu\n", stats->acquired);
+    seq_printf(m, "contended:     %llu\n", stats->contended);
+    seq_printf(m, "timeouts:      %llu\n", stats->timeouts);
+    seq_printf(m, "wait_total_ns: %llu\n", stats->wait_total_ns);
+    seq_printf(m, "wait_max_ns:   %llu\n", stats->wait_max_ns);
+    seq_printf(m, "hold_total_ns: %llu\n", stats->hold_total_ns);
+    seq_printf(m, "hold_max_ns:   %llu\n", stats->hold_max_ns);
+    seq_puts(m, "top waiters:\n");
+    for (i = 0; i < CHIP_LOCK_TOP_WAITERS; i++)
+        if (stats->top[i].count)
+            seq_printf(m, "  %-8d %-16s %10llu waits %14llu ns\n",
+                stats->top[i].pid, stats->top[i].comm,
+                stats->top[i].count, stats->top[i].wait_ns);
+    spin_unlock(&stats->lock);
+
+    return 0;
+}
+
+static int chip_lock_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, chip_lock_stats_show, inode->i_private);
+}
+
+static const struct file_operations chip_lock_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = chip_lock_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* The slow transfer log in debugfs, oldest first */
+static int chip_slow_events_show(struct seq_file *m, void *v)
+{
+    struct chip_slow_log *slow = m->private;
+    struct chip_slow_event *event;
+    unsigned int i, first;
+
+    spin_lock(&slow->lock);
+    seq_printf(m, "# %llu slow transfers, read > %u us, write > %u us\n",
+        slow->total, slow->read_us, slow->write_us);
+    seq_puts(m, "# timestamp_ns      op    reg  duration_ns  lock_wait_ns"
+        "  result adapter pid      comm\n");
+
+    first = (slow->head + CHIP_SLOW_EVENTS - slow->count) % CHIP_SLOW_EVENTS;
+    for (i = 0; i < slow->count; i++)
+    {
+        event = &slow->events[(first + i) % CHIP_SLOW_EVENTS];
+        seq_printf(m, "%-18llu  %-5s 0x%02x %12llu %13llu %7d %7d %-8d %s\n",
+            event->timestamp_ns, event->write ? "write" : "read",
+            event->reg, event->duration_ns, event->lock_wait_ns,
+            event->result, event->adapter, event->pid, event->comm);
+    }
+    spin_unlock(&slow->lock);
+
+    return 0;
+}
+
+static int chip_slow_events_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, chip_slow_events_show, inode->i_private);
+}
+
+static const struct file_operations chip_slow_events_fops = {
+    .owner = THIS_MODULE,
+    .open = chip_slow_events_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* This function is called to initialize our driver chip
+ * MCP23017.
+ *
+ * For MCP23017 to function, we first need to setup the 
+ * direction register at register address 0x0 (PORTA) and
+ * 0x01 (PORTB). Bit '1' represents input while '0' is latched
+ * output, so we need to write 0x00 for PORTA (led out), and
+ * all bits set for PORTB - 0xFF.
+ */
+static void chip_init_chip(struct chip_data *data)
+{
+    int ret;
+
+    /* Set the direction registers to PORTA = out (0x00),
+     * PORTB = in (0xFF)
+     */
+    dev_info(data->dev, "%s\n", __FUNCTION__);
+
+    chip_write_value(data, REG_CHIP_DIR_PORTA, 0x00);
+    chip_write_value(data, REG_CHIP_DIR_PORTB, 0xFF);
+
+    /* Pick up the leds as they are, a previous load of the driver
+     * may have left them on. The led framebuffer starts from them.
+     */
+    chip_lock(data);
+    ret = __chip_read_value(data, REG_CHIP_PORTA_LOUT);
+    if (ret >= 0)
+        data->led_value = ret;
+    chip_fb_show(data, data->led_value);
+    ret = __chip_read_value(data, REG_CHIP_PORTB_LOUT);
+    if (ret >= 0)
+        data->olatb_value = ret;
+    chip_unlock(data);
+
+    /* If INTB is wired to an interrupt, have the chip interrupt
+     * on any change of the dip switches until told otherwise
+     * (see chip_irq_mode).
+     */
+    if (data->bus.irq > 0)
+    {
+        data->irq_mode.enable = 0xFF;
+        chip_lock(data);
+        __chip_irq_program(data);
+        chip_unlock(data);
+    }
+}
+
+
+/* Register the switches as an input device. Switch n reports key
+ * BTN_0 + n by default, the map can be changed with EVIOCSKEYCODE.
+ * The device is managed, but chip_core_remove() unregisters it since
+ * it uses our keymap, and open files may free the data before devres
+ * gets to it.
+ */
+static int chip_input_register(struct chip_data *data)
+{
+    struct device *dev = data->dev;
+    struct input_dev *input;
+    int i, ret;
+
+    input = devm_input_allocate_device(dev);
+    if (!input)
+        return -ENOMEM;
+
+    input->name = "chip_i2c switches";
+    input->phys = dev_name(dev);
+    input->id.bustype = data->bus.bustype;
+    input->keycode = data->keymap;
+    input->keycodesize = sizeof(data->keymap[0]);
+    input->keycodemax = ARRAY_SIZE(data->keymap);
+
+    __set_bit(EV_KEY, input->evbit);
+    for (i = 0; i < ARRAY_SIZE(data->keymap); i++)
+    {
+        data->keymap[i] = BTN_0 + i;
+        __set_bit(data->keymap[i], input->keybit);
+    }
+
+    ret = input_register_device(input);
+    if (ret)
+        return ret;
+
+    data->input = input;
+    return 0;
+}
+
+/* The IIO device. Channel 0 is PORTB (the switches), channel 1 both
+ * ports as one 16 bit sample (PORTA in the low byte), followed by the
+ * timestamp. On every trigger the enabled ports are read in a single
+ * transfer and pushed to the buffer, the PORTB value also feeds the
+ * switch change path so nobody else needs to read the bus for it.
+ */
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+static const struct iio_chan_spec chip_iio_channels[] = {
+    {
+        .type = IIO_VOLTAGE,
+        .indexed = 1,
+        .channel = 0,
+        .info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
+        .scan_index = 0,
+        .scan_type = { .sign = 'u', .realbits = 8, .storagebits = 8 },
+    },
+    {
+        .type = IIO_VOLTAGE,
+        .indexed = 1,
+        .channel = 1,
+        .info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
+        .scan_index = 1,
+        .scan_type = { .sign = 'u', .realbits = 16, .storagebits = 16 },
+    },
+    IIO_CHAN_SOFT_TIMESTAMP(2),
+};
+
+static irqreturn_t chip_iio_trigger_handler(int irq, void *p)
+{
+    struct iio_poll_func *pf = p;
+    struct iio_dev *indio_dev = pf->indio_dev;
+    struct chip_data *data = *(struct chip_data **)iio_priv(indio_dev);
+    bool both = test_bit(1, indio_dev->active_scan_mask);
+    /* u8 PORTB, u16 both ports, s64 timestamp, naturally aligned */
+    u8 sample[16] __aligned(8);
+    u8 ports[2];
+    int ret;
+
+    chip_lock(data);
+    if (both)
+        ret = __chip_read_block(data, REG_CHIP_PORTA_LIN, ports, 2);
+    else
+    {
+        ret = __chip_read_value(data, REG_CHIP_PORTB_LIN);
+        ports[1] = ret;
+    }
+    if (ret >= 0)
+        __chip_switch_update(data, ports[1]);
+    chip_unlock(data);
+
+    if (ret < 0)
+        goto done;
+
+    /* Enabled channels are packed, the 16 bit one moves to the
+     * front when PORTB alone is off.
+     */
+    memset(sample, 0, sizeof(sample));
+    if (test_bit(0, indio_dev->active_scan_mask))
+    {
+        sample[0] = ports[1];
+        if (both)
+            *(u16 *)&sample[2] = ports[0] | (ports[1] << 8);
+    }
+    else if (both)
+        *(u16 *)&sample[0] = ports[0] | (ports[1] << 8);
+    if (indio_dev->scan_timestamp)
+        *(s64 *)&sample[8] = pf->timestamp;
+
+    iio_push_to_buffers(indio_dev, sample);
+
+done:
+    iio_trigger_notify_done(indio_dev->trig);
+    return IRQ_HANDLED;
+}
+
+static int chip_iio_read_raw(struct iio_dev *indio_dev,
+    struct iio_chan_spec const *chan, int *val, int *val2, long mask)
+{
+    struct chip_data *data = *(struct chip_data **)iio_priv(indio_dev);
+    u8 ports[2];
+    int ret;
+
+    if (mask != IIO_CHAN_INFO_RAW)
+        return -EINVAL;
+    if (iio_buffer_enabled(indio_dev))
+        return -EBUSY;
+
+    chip_lock(data);
+    if (chan->channel == 1)
+        ret = __chip_read_block(data, REG_CHIP_PORTA_LIN, ports, 2);
+    else
+    {
+        ret = __chip_read_value(data, REG_CHIP_PORTB_LIN);
+        ports[1] = ret;
+    }
+    if (ret >= 0)
+        __chip_switch_update(data, ports[1]);
+    chip_unlock(data);
+
+    if (ret < 0)
+        return ret;
+
+    *val = chan->channel == 1 ? ports[0] | (ports[1] << 8) : ports[1];
+    return IIO_VAL_INT;
+}
+
+static const struct iio_info chip_iio_info = {
+    .read_raw = chip_iio_read_raw,
+    .driver_module = THIS_MODULE,
+};
+
+static int chip_iio_register(struct chip_data *data)
+{
+    struct iio_dev *indio_dev;
+    int ret;
+
+    indio_dev = iio_device_alloc(sizeof(data));
+    if (!indio_dev)
+        return -ENOMEM;
+
+    *(struct chip_data **)iio_priv(indio_dev) = data;
+    indio_dev->dev.parent = data->dev;
+    indio_dev->name = CHIP_I2C_DEVICE_NAME;
+    indio_dev->info = &chip_iio_info;
+    indio_dev->modes = INDIO_DIRECT_MODE;
+    indio_dev->channels = chip_iio_channels;
+    indio_dev->num_channels = ARRAY_SIZE(chip_iio_channels);
+
+    ret = iio_triggered_buffer_setup(indio_dev, &iio_pollfunc_store_time,
+        chip_iio_trigger_handler, NULL);
+    if (ret)
+        goto free_dev;
+
+    ret = iio_device_register(indio_dev);
+    if (ret)
+        goto cleanup_buffer;
+
+    data->iio = indio_dev;
+    return 0;
+
+cleanup_buffer:
+    iio_triggered_buffer_cleanup(indio_dev);
+free_dev:
+    iio_device_free(indio_dev);
+    return ret;
+}
+
+static void chip_iio_unregister(struct chip_data *data)
+{
+    if (!data->iio)
+        return;
+
+    iio_device_unregister(data->iio);
+    iio_triggered_buffer_cleanup(data->iio);
+    iio_device_free(data->iio);
+    data->iio = NULL;
+}
+#else
+static int chip_iio_register(struct chip_data *data) { return 0; }
+static void chip_iio_unregister(struct chip_data *data) { }
+#endif /* CONFIG_IIO_TRIGGERED_BUFFER */
+
+/* Stop everything that may still touch the chip: the interrupt, the
+ * workers (the sysfs files can start most of them), requests from
+ * other drivers and the BAM engine. Then mark the data dead, open
+ * files keep it, but from now on all they get is -ENODEV. Ring
+ * threads keep running until their file is closed, with every SQE
+ * failing. Used by chip_core_remove(), and by chip_core_probe() when
+ * it fails after the chardev or the sysfs files went live.
+ */
+static void chip_core_shutdown(struct chip_data *data)
+{
+    struct chip_file * cf;
+
+    if (data->bus.irq > 0)
+        devm_free_irq(data->dev, data->bus.irq, data);
+    data->sample_ms = 0;
+    cancel_delayed_work_sync(&data->sample_work);
+    data->edge_gate_ms = 0;
+    cancel_delayed_work_sync(&data->edge_work);
+    cancel_delayed_work_sync(&data->storm_work);
+    cancel_delayed_work_sync(&data->hold_work);
+    data->stats_interval_ms = 0;
+    cancel_delayed_work_sync(&data->stats_work);
+    /* Ring threads of open files can still deliver switch events */
+    spin_lock(&data->genl_lock);
+    data->genl_dead = true;
+    spin_unlock(&data->genl_lock);
+    cancel_delayed_work_sync(&data->genl_work);
+    cancel_work_sync(&data->fair_work);
+    cancel_delayed_work_sync(&data->fb_work);
+
+    /* Refuse new requests from other drivers, finish the queued ones */
+    spin_lock_irq(&data->submit_lock);
+    data->submit_dead = true;
+    spin_unlock_irq(&data->submit_lock);
+    flush_work(&data->submit_work);
+
+    chip_bam_set_rate(data, 0);
+
+    chip_lock(data);
+    chip_files_lock();
+    data->dead = true;
+    chip_i2c_chip = NULL;
+    list_for_each_entry(cf, &chip_files, list)
+        if (cf->data == data)
+        {
+            wake_up_interruptible(&cf->wait);
+            if (cf->ring)
+                wake_up_interruptible(&cf->ring->cq_wait);
+        }
+    chip_files_unlock();
+    chip_unlock(data);
+}
+
+/* The following functions are called by the transports once they
+ * found a chip (see chip_bus_i2c.c and chip_bus_spi.c). The duty of
+ * chip_core_probe() is to allocate the client's data, initialize
+ * the data structures needed, and to call chip_init_chip() which
+ * will initialize our hardware. 
+ *
+ * This function is also needed to initialize sysfs files on the system.
+ */
+int chip_core_probe(struct device *dev, const struct chip_bus *bus)
+{
+    int retval = 0;
+    struct chip_data *data = NULL;
+
+    printk("chip_i2c: %s (%s)\n", __FUNCTION__, bus->ops->name);
+
+    /* Only one chip is supported, whatever bus it sits on */
+    if (chip_i2c_chip)
+        return -EBUSY;
+
+    /* Allocate the client's data here */
+    data = kzalloc(sizeof(struct chip_data), GFP_KERNEL);
+    if(!data)
+        return -ENOMEM;
+    kref_init(&data->kref);
+
+    /* Initialize client's data to default */
+    dev_set_drvdata(dev, data);
+    /* Initialize the mutex */
+    mutex_init(&data->update_lock);
+    spin_lock_init(&data->lock_stats.lock);
+    spin_lock_init(&data->slow.lock);
+    data->slow.read_us = CHIP_SLOW_READ_US;
+    data->slow.write_us = CHIP_SLOW_WRITE_US;
+    seqlock_init(&data->switch_seq);
+    INIT_DELAYED_WORK(&data->sample_work, chip_sample_work);
+    spin_lock_init(&data->genl_lock);
+    INIT_DELAYED_WORK(&data->genl_work, chip_genl_work);
+    INIT_DELAYED_WORK(&data->stats_work, chip_stats_work);
+    INIT_WORK(&data->fair_work, chip_fair_work);
+    INIT_DELAYED_WORK(&data->fb_work, chip_fb_work);
+    mutex_init(&data->frame_lock);
+    mutex_init(&data->bam_lock);
+    spin_lock_init(&data->leds_lock);
+    INIT_DELAYED_WORK(&data->leds_work, chip_leds_work);
+    data->led_flush_ms = CHIP_LED_FLUSH_MS;
+    INIT_DELAYED_WORK(&data->edge_work, chip_edge_work);
+    INIT_DELAYED_WORK(&data->storm_work, chip_storm_work);
+    INIT_DELAYED_WORK(&data->hold_work, chip_hold_work);
+    spin_lock_init(&data->submit_lock);
+    INIT_LIST_HEAD(&data->submit_list);
+    INIT_WORK(&data->submit_work, chip_submit_work);
+    data->storm_rate = CHIP_STORM_RATE;
+    data->event_batch_ms = CHIP_GENL_BATCH_MS;
+    data->fb_delay_ms = CHIP_FB_DELAY_MS;
+
+    /* If our driver requires additional data initialization
+     * we do it here. The transport we go through is copied,
+     * we may still drop the irq below.
+     **/
+    data->dev = dev;
+    data->bus = *bus;
+    data->switch_value = -1;
+
+    /* Bus occupancy is accounted per client and per adapter */
+    spin_lock_init(&data->occ.lock);
+    chip_set_bus_hz(data, data->bus.hz);
+    data->adapter_stats = chip_adapter_get(data->bus.adapter);
+    if (!data->adapter_stats)
+    {
+        retval = -ENOMEM;
+        goto put_data;
+    }
+
+    /* The page behind the led framebuffer */
+    data->fb_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!data->fb_page)
+    {
+        retval = -ENOMEM;
+        goto put_adapter;
+    }
+
+    /* initialize our hardware */
+    chip_init_chip(data);
+
+    retval = chip_input_register(data);
+    if (retval)
+    {
+        printk("%s: Failed to register input device!\n", __FUNCTION__);
+        goto put_adapter;
+    }
+
+    /* The switch change path is driven by INTB if we have it,
+     * otherwise user space can enable the sampler.
+     */
+    if (data->bus.irq > 0)
+    {
+        retval = devm_request_threaded_irq(dev, data->bus.irq, chip_i2c_irq,
+            chip_i2c_irq_thread, IRQF_TRIGGER_LOW | IRQF_ONESHOT,
+            CHIP_I2C_DEVICE_NAME, data);
+        if (retval)
+        {
+            dev_warn(dev, "Failed to request irq %d, sampling only\n",
+                data->bus.irq);
+            data->bus.irq = 0;
+            retval = 0;
+        }
+    }
+
+    /* The input capture ring, only the interrupt fills it. Capture
+     * is optional, carry on without it.
+     */
+    if (data->bus.irq > 0)
+    {
+        data->capture_mem = vmalloc_user(PAGE_ALIGN(
+            sizeof(struct chip_i2c_capture_hdr) +
+            CHIP_CAPTURE_ENTRIES * sizeof(struct chip_i2c_capture)));
+        if (data->capture_mem)
+        {
+            data->capture_hdr = data->capture_mem;
+            data->capture_hdr->entries = CHIP_CAPTURE_ENTRIES;
+            data->captures = data->capture_mem +
+                sizeof(struct chip_i2c_capture_hdr);
+        }
+        else
+            dev_warn(dev, "No memory for input capture\n");
+    }
+
+    /* In our arbitrary hardware, we only have
+     * one instance of this existing on the bus.
+     * Therefore we set the global pointer of this
+     * chip.
+     */
+    chip_i2c_chip = data;
+
+    /* We now create our character device driver */
+    chip_i2c_major = register_chrdev(0, CHIP_I2C_DEVICE_NAME,
+        &chip_i2c_fops);
+    if (chip_i2c_major < 0)
+    {
+        retval = chip_i2c_major;
+        printk("%s: Failed to register char device!\n", __FUNCTION__);
+        goto shutdown;
+    }
+
+    chip_i2c_class = class_create(THIS_MODULE, CHIP_I2C_DEVICE_NAME);
+    if (IS_ERR(chip_i2c_class))
+    {
+        retval = PTR_ERR(chip_i2c_class);
+        printk("%s: Failed to create class!\n", __FUNCTION__);
+        goto unreg_chrdev;
+    }
+
+    chip_i2c_device = device_create(chip_i2c_class, NULL, 
+        MKDEV(chip_i2c_major, 0),
+        NULL,
+        CHIP_I2C_DEVICE_NAME "_leds");
+    if (IS_ERR(chip_i2c_device))
+    {
+        retval = PTR_ERR(chip_i2c_device);
+        printk("%s: Failed to create device!\n", __FUNCTION__);
+        goto unreg_class;
+    }
+
+
+    // We now register our sysfs attributs. 
+    retval = sysfs_create_group(&dev->kobj, &chip_i2c_attr_group);
+    if (retval)
+    {
+        printk("%s: Failed to create sysfs attributes!\n", __FUNCTION__);
+        goto destroy_device;
+    }
+
+    retval = chip_leds_register(data);
+    if (retval)
+    {
+        printk("%s: Failed to register the leds!\n", __FUNCTION__);
+        goto remove_group;
+    }
+
+    retval = chip_iio_register(data);
+    if (retval)
+    {
+        printk("%s: Failed to register the iio device!\n", __FUNCTION__);
+        goto unreg_leds;
+    }
+
+    /* Debugging aids are optional, failures are ignored */
+    if (!IS_ERR_OR_NULL(chip_debugfs_root))
+    {
+        data->debugfs = debugfs_create_dir(dev_name(dev), chip_debugfs_root);
+        if (!IS_ERR_OR_NULL(data->debugfs))
+        {
+            debugfs_create_file("update_lock", S_IRUSR, data->debugfs,
+                &data->lock_stats, &chip_lock_stats_fops);
+            debugfs_create_file("slow_events", S_IRUSR, data->debugfs,
+                &data->slow, &chip_slow_events_fops);
+            debugfs_create_u32("slow_read_us", S_IRUSR | S_IWUSR,
+                data->debugfs, &data->slow.read_us);
+            debugfs_create_u32("slow_write_us", S_IRUSR | S_IWUSR,
+                data->debugfs, &data->slow.write_us);
+            debugfs_create_u32("bam_overruns", S_IRUSR,
+                data->debugfs, &data->bam_overruns);
+        }
+    }
+
+    /* Edges are only counted by the interrupt, and so are the
+     * frequencies derived from them.
+     */
+    if (data->bus.irq > 0)
+    {
+        data->edge_gate_ms = CHIP_EDGE_GATE_MS;
+        schedule_delayed_work(&data->edge_work,
+            msecs_to_jiffies(data->edge_gate_ms));
+    }
+
+    return 0;
+    /* Cleanup on failed operations */
+
+unreg_leds:
+    chip_leds_unregister(data, ARRAY_SIZE(data->leds));
+remove_group:
+    sysfs_remove_group(&dev->kobj, &chip_i2c_attr_group);
+destroy_device:
+    device_destroy(chip_i2c_class, MKDEV(chip_i2c_major, 0));
+unreg_class:
+    class_unregister(chip_i2c_class);
+    class_destroy(chip_i2c_class);
+unreg_chrdev:
+    unregister_chrdev(chip_i2c_major, CHIP_I2C_DEVICE_NAME);
+shutdown:
+    /* Files may have been opened and sysfs stores may have started
+     * workers by now. The irq is devm managed, but must not outlive
+     * the data either.
+     */
+    chip_core_shutdown(data);
+    /* Devres would only get to it after the data is gone */
+    if (data->input)
+        input_unregister_device(data->input);
+    data->input = NULL;
+put_adapter:
+    chip_adapter_put(data->adapter_stats);
+put_data:
+    chip_data_put(data);
+    printk("%s: Driver initialization failed!\n", __FUNCTION__);
+    return retval;
+}
+
+/* This function is called by the transports whenever the bus or
+ * the driver is removed from the system. We perform cleanup here and 
+ * unregister our sysfs hooks/attributes.
+ **/
+int chip_core_remove(struct device *dev)
+{
+    struct chip_data * data = dev_get_drvdata(dev);
+
+    printk("chip_i2c: %s\n", __FUNCTION__);
+
+    /* The sysfs files restart the workers below, remove them first.
+     * This waits for the stores already running.
+     */
+    sysfs_remove_group(&dev->kobj, &chip_i2c_attr_group);
+
+    /* Stop the switch change path first */
+    chip_iio_unregister(data);
+    chip_leds_unregister(data, ARRAY_SIZE(data->leds));
+    chip_core_shutdown(data);
+
+    debugfs_remove_recursive(data->debugfs);
+
+    device_destroy(chip_i2c_class, MKDEV(chip_i2c_major, 0));
+    class_unregister(chip_i2c_class);
+    class_destroy(chip_i2c_class);
+    unregister_chrdev(chip_i2c_major, CHIP_I2C_DEVICE_NAME);
+
+    if (data->input)
+        input_unregister_device(data->input);
+    data->input = NULL;
+
+    chip_adapter_put(data->adapter_stats);
+    chip_data_put(data);
+
+    return 0;
+}
+
+#ifdef CONFIG_PERF_EVENTS
+/* The chip_i2c PMU. It exposes our event counters to the standard
+ * perf tooling, e.g. `perf stat -e chip_i2c/bus_writes/`. This is a
+ * counting only PMU living in the software context, so events can
+ * be counted per task or per cpu (system wide), but not sampled.
+ *
+ * An event remembers the counter value of its cpu when it is
+ * scheduled in and accumulates the difference when it is read or
+ * scheduled out.
+ */
+static struct pmu chip_pmu;
+
+static void chip_pmu_update(struct perf_event *event)
+{
+    u64 now, prev;
+
+    now = __this_cpu_read(chip_counters[event->attr.config]);
+    prev = local64_xchg(&event->hw.prev_count, now);
+    local64_add(now - prev, &event->count);
+}
+
+/* This kernel's struct pmu has no module owner, so every event pins
+ * the module itself until perf destroys it.
+ */
+static void chip_pmu_event_destroy(struct perf_event *event)
+{
+    module_put(THIS_MODULE);
+}
+
+static int chip_pmu_event_init(struct perf_event *event)
+{
+    if (event->attr.type != chip_pmu.type)
+        return -ENOENT;
+
+    if (event->attr.config >= CHIP_CNT_MAX)
+        return -EINVAL;
+
+    if (is_sampling_event(event))
+        return -EOPNOTSUPP;
+
+    if (!try_module_get(THIS_MODULE))
+        return -ENODEV;
+    event->destroy = chip_pmu_event_destroy;
+
+    return 0;
+}
+
+static void chip_pmu_start(struct perf_event *event, int flags)
+{
+    local64_set(&event->hw.prev_count,
+        __this_cpu_read(chip_counters[event->attr.config]));
+    event->hw.state = 0;
+}
+
+static void chip_pmu_stop(struct perf_event *event, int flags)
+{
+    if (event->hw.state & PERF_HES_STOPPED)
+        return;
+
+    chip_pmu_update(event);
+    event->hw.state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int chip_pmu_add(struct perf_event *event, int flags)
+{
+    event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+    if (flags & PERF_EF_START)
+        chip_pmu_start(event, flags);
+
+    return 0;
+}
+
+static void chip_pmu_del(struct perf_event *event, int flags)
+{
+    chip_pmu_stop(event, PERF_EF_UPDATE);
+}
+
+static void chip_pmu_read(struct perf_event *event)
+{
+    if (!(event->hw.state & PERF_HES_STOPPED))
+        chip_pmu_update(event);
+}
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute * chip_pmu_format_attrs[] = {
+    &format_attr_event.attr,
+    NULL
+};
+
+static struct attribute_group chip_pmu_format_group = {
+    .name = "format",
+    .attrs = chip_pmu_format_attrs,
+};
+
+#define CHIP_PMU_EVENT(_name, _counter) \
+    PMU_EVENT_ATTR_STRING(_name, chip_pmu_event_##_name, \
+        "event=" __stringify(_counter))
+
+CHIP_PMU_EVENT(bus_reads, 0);
+CHIP_PMU_EVENT(bus_writes, 1);
+CHIP_PMU_EVENT(bus_bytes, 2);
+CHIP_PMU_EVENT(lock_contended, 3);
+CHIP_PMU_EVENT(coalesced_writes, 4);
+CHIP_PMU_EVENT(bus_errors, 5);
+
+static struct attribute * chip_pmu_event_attrs[] = {
+    &chip_pmu_event_bus_reads.attr.attr,
+    &chip_pmu_event_bus_writes.attr.attr,
+    &chip_pmu_event_bus_bytes.attr.attr,
+    &chip_pmu_event_lock_contended.attr.attr,
+    &chip_pmu_event_coalesced_writes.attr.attr,
+    &chip_pmu_event_bus_errors.attr.attr,
+    NULL
+};
+
+static struct attribute_group chip_pmu_events_group = {
+    .name = "events",
+    .attrs = chip_pmu_event_attrs,
+};
+
+static const struct attribute_group * chip_pmu_attr_groups[] = {
+    &chip_pmu_format_group,
+    &chip_pmu_events_group,
+    NULL
+};
+
+static struct pmu chip_pmu = {
+    .task_ctx_nr    = perf_sw_context,
+    .attr_groups    = chip_pmu_attr_groups,
+    .event_init     = chip_pmu_event_init,
+    .add            = chip_pmu_add,
+    .del            = chip_pmu_del,
+    .start          = chip_pmu_start,
+    .stop           = chip_pmu_stop,
+    .read           = chip_pmu_read,
+};
+
+static int chip_pmu_init(void)
+{
+    return perf_pmu_register(&chip_pmu, CHIP_I2C_DEVICE_NAME, -1);
+}
+
+static void chip_pmu_exit(void)
+{
+    perf_pmu_unregister(&chip_pmu);
+}
+#else
+static int chip_pmu_init(void) { return -ENODEV; }
+static void chip_pmu_exit(void) { }
+#endif /* CONFIG_PERF_EVENTS */
+
+/* The two functions below adds the drivers
+ * and perfom cleanup operations. Besides registering
+ * the I2C and SPI transports, we also register our perf PMU
+ * here since it is shared by all our clients.
+ */
+static bool chip_pmu_registered;
+
+static int __init chip_i2c_init(void)
+{
+    int ret;
+
+    printk("chip: Entering init routine!\n");
+
+    /* perf support is optional, carry on without it */
+    chip_pmu_registered = (chip_pmu_init() == 0);
+    if (!chip_pmu_registered)
+        printk("chip: perf PMU not available\n");
+
+    chip_genl_registered = (chip_genl_init() == 0);
+    if (!chip_genl_registered)
+        printk("chip: netlink family not available\n");
+
+    chip_debugfs_root = debugfs_create_dir(CHIP_I2C_DEVICE_NAME, NULL);
+    if (!IS_ERR_OR_NULL(chip_debugfs_root))
+        debugfs_create_file("chip_i2c_mutex", S_IRUSR, chip_debugfs_root,
+            &chip_i2c_mutex_stats, &chip_lock_stats_fops);
+
+    ret = chip_bus_i2c_init();
+    if (!ret)
+    {
+        ret = chip_bus_spi_init();
+        if (ret)
+            chip_bus_i2c_exit();
+    }
+    if (ret)
+    {
+        debugfs_remove_recursive(chip_debugfs_root);
+        if (chip_genl_registered)
+            genl_unregister_family(&chip_genl_family);
+        if (chip_pmu_registered)
+            chip_pmu_exit();
+    }
+
+    return ret;
+}
+module_init(chip_i2c_init);
+
+static void __exit chip_i2c_cleanup(void)
+{
+    printk("chip: Removing driver from kernel\n");
+
+    chip_bus_spi_exit();
+    chip_bus_i2c_exit();
+    debugfs_remove_recursive(chip_debugfs_root);
+    if (chip_genl_registered)
+        genl_unregister_family(&chip_genl_family);
+    if (chip_pmu_registered)
+        chip_pmu_exit();
+}
+module_exit(chip_i2c_cleanup);
+
+MODULE_AUTHOR("Vergil Cola <vpcola@gmail.com>");
+MODULE_DESCRIPTION("Chip I2C Driver");
+MODULE_LICENSE("GPL");
+
@@ -0,0 +1,71 @@
+/*
+ * Chip I2C Driver - transports
+ *
+ * Copyright (C) 2014 Vergil Cola (vpcola@gmail.com)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * This header is private to the driver. The core (chip_core.c) does
+ * not know how the chip is wired, it only talks to it through a
+ * struct chip_bus filled in by one of the transports: the MCP23017
+ * on I2C (chip_bus_i2c.c) or the MCP23S17 on SPI (chip_bus_spi.c).
+ * Both chips have the same register map.
+ */
+
+#ifndef _CHIP_CORE_H
+#define _CHIP_CORE_H
+
+#include <linux/types.h>
+#include <linux/device.h>
+
+/* The register accessors of a transport. They are always called
+ * with the chip's update_lock held and may sleep. read() returns
+ * the register value or a negative errno, the others 0 or a
+ * negative errno. A short block read is an error (-EIO).
+ *
+ * wire_ns() estimates how long a transfer of len registers keeps
+ * the bus busy at the given clock, for the occupancy statistics.
+ */
+struct chip_bus_ops {
+    const char *name;
+    int (*read)(void *priv, u8 reg);
+    int (*write)(void *priv, u8 reg, u8 value);
+    int (*read_block)(void *priv, u8 reg, u8 *values, u8 len);
+    int (*write_block)(void *priv, u8 reg, const u8 *values, u8 len);
+    u32 (*wire_ns)(unsigned int hz, bool read, unsigned int len);
+};
+
+/* What the core needs to know about the bus the chip sits on.
+ * Chips sharing an adapter (or SPI controller) share its occupancy
+ * statistics, adapter only serves as the key for that.
+ */
+struct chip_bus {
+    const struct chip_bus_ops *ops;
+    void *priv;             /* Passed to the ops */
+    void *adapter;          /* The i2c_adapter or spi_master */
+    int adapter_id;         /* Bus number, for the slow transfer log */
+    unsigned int hz;        /* Bus clock */
+    int irq;                /* INTB, 0 if not wired */
+    u16 bustype;            /* BUS_I2C or BUS_SPI, for the input device */
+};
+
+/* Called by the transports from their probe() and remove(). The
+ * core keeps a copy of bus, and its data as the device's drvdata.
+ */
+int chip_core_probe(struct device *dev, const struct chip_bus *bus);
+int chip_core_remove(struct device *dev);
+
+int chip_bus_i2c_init(void);
+void chip_bus_i2c_exit(void);
+
+#if IS_ENABLED(CONFIG_SPI_MASTER)
+int chip_bus_spi_init(void);
+void chip_bus_spi_exit(void);
+#else
+static inline int chip_bus_spi_init(void) { return 0; }
+static inline void chip_bus_spi_exit(void) { }
+#endif
+
+#endif /* _CHIP_CORE_H */
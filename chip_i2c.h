@@ -0,0 +1,399 @@
+/*
+ * Chip I2C Driver - user space interface
+ *
+ * Copyright (C) 2014 Vergil Cola (vpcola@gmail.com)
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, version 2 of the License.
+ *
+ * This header is shared between the driver and user space programs
+ * that talk to /dev/chip_i2c_leds through ioctl().
+ */
+
+#ifndef _CHIP_I2C_H
+#define _CHIP_I2C_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define CHIP_I2C_IOC_MAGIC      0xC1
+
+/* Reading the dip switches (PORTB) through ioctl. The caller sets
+ * deadline_ms to the maximum time it is willing to wait for the bus
+ * (0 means wait as long as it takes). If the bus can not be reached
+ * in time, the driver returns the last known value and sets
+ * CHIP_I2C_SWITCH_STALE in flags. Values served from the driver's
+ * read cache (see chip_switch_max_age) have CHIP_I2C_SWITCH_CACHED
+ * set.
+ */
+#define CHIP_I2C_SWITCH_STALE   0x01
+#define CHIP_I2C_SWITCH_CACHED  0x02
+
+struct chip_i2c_switch_read {
+    __u32 deadline_ms;  /* in: max wait for the bus, 0 = block */
+    __u8  value;        /* out: PORTB value */
+    __u8  flags;        /* out: CHIP_I2C_SWITCH_* */
+    __u16 reserved;
+};
+
+#define CHIP_I2C_IOC_READ_SWITCH \
+    _IOWR(CHIP_I2C_IOC_MAGIC, 0x01, struct chip_i2c_switch_read)
+
+/* The reflex map drives the leds (PORTA) straight from the dip
+ * switches (PORTB) whenever the switches change, without a round
+ * trip through user space. Only the led bits in mask are driven by
+ * the map, in LUT mode lut[switches] gives the led value.
+ */
+#define CHIP_I2C_REFLEX_OFF     0
+#define CHIP_I2C_REFLEX_COPY    1
+#define CHIP_I2C_REFLEX_INVERT  2
+#define CHIP_I2C_REFLEX_LUT     3
+
+struct chip_i2c_reflex {
+    __u8 mode;          /* CHIP_I2C_REFLEX_* */
+    __u8 mask;          /* led bits driven by the map */
+    __u8 reserved[2];
+    __u8 lut[256];      /* led value for each switch value */
+};
+
+#define CHIP_I2C_IOC_SET_REFLEX \
+    _IOW(CHIP_I2C_IOC_MAGIC, 0x02, struct chip_i2c_reflex)
+#define CHIP_I2C_IOC_GET_REFLEX \
+    _IOR(CHIP_I2C_IOC_MAGIC, 0x03, struct chip_i2c_reflex)
+
+/* The interrupt mode of the dip switches, one bit per switch. Enabled
+ * switches interrupt on any change, or, if their compare bit is set,
+ * when they leave their defval bit (right away if they already differ
+ * from it). The chip would keep interrupting while they differ, so the
+ * driver samples such a switch instead until it is back at its defval.
+ * Transitions of other switches are filtered by the chip and cost no
+ * bus traffic. Needs the interrupt to be wired.
+ */
+struct chip_i2c_irq_mode {
+    __u8 enable;        /* GPINTENB */
+    __u8 compare;       /* INTCONB */
+    __u8 defval;        /* DEFVALB */
+    __u8 reserved;
+};
+
+#define CHIP_I2C_IOC_SET_IRQ_MODE \
+    _IOW(CHIP_I2C_IOC_MAGIC, 0x0B, struct chip_i2c_irq_mode)
+#define CHIP_I2C_IOC_GET_IRQ_MODE \
+    _IOR(CHIP_I2C_IOC_MAGIC, 0x0C, struct chip_i2c_irq_mode)
+
+/* Submission/completion rings, modeled on io_uring. After
+ * CHIP_I2C_IOC_RING_SETUP, the rings are mmap()ed from offset 0 of
+ * the chardev (opened O_RDWR) with the returned size. The mapping
+ * starts with struct chip_i2c_ring_hdr, followed by the SQE array at
+ * sq_off and the CQE array at cq_off.
+ *
+ * User space fills sqes[sq_tail & (sq_entries - 1)] and then bumps
+ * sq_tail, the driver consumes entries up to sq_tail and posts a
+ * CQE for each at cq_tail. User space bumps cq_head as it reaps
+ * them. Heads and tails are free running counters.
+ *
+ * A driver thread drains the SQ. With CHIP_I2C_RING_SQPOLL it keeps
+ * polling for sq_idle_ms after the last SQE before going to sleep.
+ * Once asleep CHIP_I2C_SQ_NEED_WAKEUP is set in sq_flags and
+ * CHIP_I2C_IOC_RING_ENTER must be called to wake it, its argument is
+ * the number of CQEs to wait for (0 to return right away, at most
+ * cq_entries), whether their SQEs were submitted yet or not. If
+ * eventfd is not -1, it is signalled whenever new CQEs are posted.
+ *
+ * Writes are only allowed to the led latch (OLATA), reads to the
+ * port and latch registers (0x12 to 0x15).
+ */
+#define CHIP_I2C_OP_READ            0
+#define CHIP_I2C_OP_WRITE           1
+
+#define CHIP_I2C_RING_SQPOLL        0x01    /* setup flags */
+#define CHIP_I2C_SQ_NEED_WAKEUP     0x01    /* sq_flags */
+
+struct chip_i2c_sqe {
+    __u8  opcode;       /* CHIP_I2C_OP_* */
+    __u8  reg;
+    __u8  value;        /* value to write */
+    __u8  flags;
+    __u32 reserved;
+    __u64 user_data;    /* copied to the CQE */
+};
+
+struct chip_i2c_cqe {
+    __u64 user_data;
+    __s32 res;          /* value read, 0 for writes, or -errno */
+    __u32 flags;
+};
+
+struct chip_i2c_ring_hdr {
+    __u32 sq_head;      /* written by the driver */
+    __u32 sq_tail;      /* written by user space */
+    __u32 sq_flags;     /* CHIP_I2C_SQ_* */
+    __u32 cq_head;      /* written by user space */
+    __u32 cq_tail;      /* written by the driver */
+    __u32 reserved[3];
+};
+
+struct chip_i2c_ring_setup {
+    __u32 sq_entries;   /* in: power of 2, up to 4096 */
+    __u32 cq_entries;   /* in: power of 2, up to 4096 */
+    __u32 flags;        /* in: CHIP_I2C_RING_* */
+    __u32 sq_idle_ms;   /* in: SQPOLL idle time, up to 1000 */
+    __s32 eventfd;      /* in: completion eventfd or -1 */
+    __u32 sq_off;       /* out: offset of the SQE array */
+    __u32 cq_off;       /* out: offset of the CQE array */
+    __u32 size;         /* out: size of the mapping */
+};
+
+#define CHIP_I2C_IOC_RING_SETUP \
+    _IOWR(CHIP_I2C_IOC_MAGIC, 0x04, struct chip_i2c_ring_setup)
+#define CHIP_I2C_IOC_RING_ENTER \
+    _IO(CHIP_I2C_IOC_MAGIC, 0x05)
+
+/* The chardev can be opened by any number of processes. Bytes
+ * written to it go to the leds, under the arbitration policy set in
+ * the chip_led_policy attribute:
+ *
+ *   last-writer   every write goes straight to the leds
+ *   owner         a file only changes the leds it claimed with
+ *                 CHIP_I2C_IOC_CLAIM_LEDS (argument: led mask, claims
+ *                 are exclusive, 0 drops the claim, the file must be
+ *                 open for writing), writes from a file without a
+ *                 claim fail with EPERM
+ *   fair          writes are queued per file and interleaved one
+ *                 byte per file
+ *
+ * Files opened for reading get a struct chip_i2c_event for every
+ * change of the dip switches from read(), poll() tells when there
+ * are some. CHIP_I2C_IOC_FILE_STATS returns the file's statistics.
+ */
+#define CHIP_I2C_EVENT_COALESCED    0x01    /* changed includes switches */
+                                            /* sampled during a storm */
+
+struct chip_i2c_event {
+    __u64 timestamp_ns;     /* CLOCK_MONOTONIC */
+    __u8  old;              /* previous PORTB value */
+    __u8  value;            /* new PORTB value */
+    __u8  changed;          /* bits that changed */
+    __u8  flags;            /* CHIP_I2C_EVENT_* */
+    __u32 reserved;
+};
+
+struct chip_i2c_file_stats {
+    __u64 writes;           /* led writes issued for this file */
+    __u64 write_errors;
+    __u64 events;           /* switch events queued for this file */
+    __u64 events_dropped;   /* lost because the reader fell behind */
+};
+
+#define CHIP_I2C_IOC_CLAIM_LEDS \
+    _IO(CHIP_I2C_IOC_MAGIC, 0x06)
+#define CHIP_I2C_IOC_FILE_STATS \
+    _IOR(CHIP_I2C_IOC_MAGIC, 0x07, struct chip_i2c_file_stats)
+
+/* Readers only get the switch changes they subscribed to: a change
+ * of one of the switches in mask, in one of the directions in edges.
+ * By default a reader gets all of them.
+ */
+#define CHIP_I2C_SUB_RISING     0x01
+#define CHIP_I2C_SUB_FALLING    0x02
+
+struct chip_i2c_subscription {
+    __u8  mask;             /* switches of interest */
+    __u8  edges;            /* CHIP_I2C_SUB_* */
+    __u16 reserved;
+};
+
+#define CHIP_I2C_IOC_SUBSCRIBE \
+    _IOW(CHIP_I2C_IOC_MAGIC, 0x0D, struct chip_i2c_subscription)
+
+/* Change only some of the leds. Under the owner policy the driver
+ * composes PORTA from the bits of every owner, so each program can
+ * update its own leds without reading the others' first.
+ */
+struct chip_i2c_leds {
+    __u8  mask;             /* leds to change */
+    __u8  value;            /* their new state */
+    __u16 reserved;
+};
+
+#define CHIP_I2C_IOC_SET_LEDS \
+    _IOW(CHIP_I2C_IOC_MAGIC, 0x08, struct chip_i2c_leds)
+
+/* The led framebuffer. A page mmap()ed (MAP_SHARED) from offset
+ * CHIP_I2C_FB_OFFSET of the chardev mirrors the leds, its first byte
+ * is the PORTA output latch. Stores to it are picked up by the driver
+ * after at most chip_fb_delay ms and written to the leds if they
+ * changed, regardless of the led policy.
+ */
+#define CHIP_I2C_FB_OFFSET      0x40000000
+
+/* Double buffered frames. CHIP_I2C_IOC_FRAME_SET updates the bits in
+ * mask of the device's back buffer, CHIP_I2C_IOC_FRAME_COMMIT writes
+ * the whole buffer to the output latches in one transfer (one per
+ * latch on i2c adapters without block transfers). If the
+ * chip_frame_rate attribute is set, commits are paced to that rate.
+ */
+struct chip_i2c_frame {
+    __u8  olat[2];          /* OLATA (leds) and OLATB */
+    __u8  mask[2];          /* bits of olat to set in the back buffer */
+};
+
+#define CHIP_I2C_IOC_FRAME_SET \
+    _IOW(CHIP_I2C_IOC_MAGIC, 0x09, struct chip_i2c_frame)
+#define CHIP_I2C_IOC_FRAME_COMMIT \
+    _IO(CHIP_I2C_IOC_MAGIC, 0x0A)
+
+/* Input capture. With the interrupt wired and chip_capture set to 1,
+ * every edge on PORTB is recorded in a ring mmap()ed from offset
+ * CHIP_I2C_CAPTURE_OFFSET of the chardev: struct chip_i2c_capture_hdr
+ * followed by entries (a power of 2) struct chip_i2c_capture.
+ *
+ * The driver writes captures[head & (entries - 1)] and then bumps
+ * head, user space reads entries up to head and bumps tail. Heads and
+ * tails are free running counters. Edges that find the ring full are
+ * counted in dropped. Since user space writes tail, the ring must be
+ * mapped PROT_READ | PROT_WRITE and MAP_SHARED from a file opened
+ * O_RDWR, other mappings fail with EACCES.
+ *
+ * Edges that raised the interrupt carry the time the interrupt fired.
+ * Edges that followed before the driver got to read the port carry
+ * the time of that read and CHIP_I2C_CAPTURE_LATE.
+ */
+#define CHIP_I2C_CAPTURE_OFFSET 0x50000000
+
+#define CHIP_I2C_EDGE_FALLING   0
+#define CHIP_I2C_EDGE_RISING    1
+
+#define CHIP_I2C_CAPTURE_LATE   0x01
+
+struct chip_i2c_capture_hdr {
+    __u32 head;             /* written by the driver */
+    __u32 tail;             /* written by user space */
+    __u32 entries;
+    __u32 dropped;
+};
+
+struct chip_i2c_capture {
+    __u64 timestamp_ns;     /* CLOCK_MONOTONIC */
+    __u8  pin;              /* PORTB bit */
+    __u8  edge;             /* CHIP_I2C_EDGE_* */
+    __u8  flags;            /* CHIP_I2C_CAPTURE_* */
+    __u8  reserved[5];
+};
+
+/* Generic netlink. The "chip_i2c" family multicasts to its "events"
+ * group:
+ *
+ *   CHIP_I2C_CMD_SWITCH_EVENTS  a batch of switch changes of a device,
+ *                               one nested CHIP_I2C_A_EVENT each, and
+ *                               CHIP_I2C_A_DROPPED if events were lost
+ *   CHIP_I2C_CMD_STATS          a periodic stats snapshot (see the
+ *                               chip_stats_interval attribute)
+ *
+ * Every message carries the device name (e.g. "1-0021") in
+ * CHIP_I2C_A_DEVICE.
+ */
+#define CHIP_I2C_GENL_NAME      "chip_i2c"
+#define CHIP_I2C_GENL_VERSION   1
+#define CHIP_I2C_GENL_MCGRP     "events"
+
+enum {
+    CHIP_I2C_CMD_UNSPEC,
+    CHIP_I2C_CMD_SWITCH_EVENTS,
+    CHIP_I2C_CMD_STATS,
+    __CHIP_I2C_CMD_MAX,
+};
+#define CHIP_I2C_CMD_MAX        (__CHIP_I2C_CMD_MAX - 1)
+
+enum {
+    CHIP_I2C_A_UNSPEC,
+    CHIP_I2C_A_DEVICE,              /* string */
+    CHIP_I2C_A_EVENT,               /* nested CHIP_I2C_EVENT_A_* */
+    CHIP_I2C_A_DROPPED,             /* u32, events lost before this batch */
+    CHIP_I2C_A_BUS_READS,           /* u64, driver wide counters */
+    CHIP_I2C_A_BUS_WRITES,          /* u64 */
+    CHIP_I2C_A_BUS_BYTES,           /* u64 */
+    CHIP_I2C_A_LOCK_CONTENDED,      /* u64 */
+    CHIP_I2C_A_COALESCED_WRITES,    /* u64 */
+    CHIP_I2C_A_BUS_ERRORS,          /* u64 */
+    CHIP_I2C_A_OCCUPANCY,           /* u32, device's bus occupancy over
+                                       the last second, in 1/100 % */
+    __CHIP_I2C_A_MAX,
+};
+#define CHIP_I2C_A_MAX          (__CHIP_I2C_A_MAX - 1)
+
+enum {
+    CHIP_I2C_EVENT_A_UNSPEC,
+    CHIP_I2C_EVENT_A_TIMESTAMP,     /* u64, CLOCK_MONOTONIC ns */
+    CHIP_I2C_EVENT_A_OLD,           /* u8, previous PORTB value */
+    CHIP_I2C_EVENT_A_VALUE,         /* u8, new PORTB value */
+    __CHIP_I2C_EVENT_A_MAX,
+};
+#define CHIP_I2C_EVENT_A_MAX    (__CHIP_I2C_EVENT_A_MAX - 1)
+
+#ifdef __KERNEL__
+
+#include <linux/list.h>
+
+struct device;
+
+/* In kernel switch handlers. Another module can attach a handler that
+ * runs on every change of the dip switches, in the driver's switch
+ * change path, with the old and new PORTB values. The handler may
+ * sleep, but must not call back into the driver. *olat holds the
+ * current led value on entry, the handler returns a combination of:
+ *
+ *   CHIP_I2C_VERDICT_WRITE     write *olat to the leds (PORTA)
+ *   CHIP_I2C_VERDICT_FORWARD   pass the event on to user space
+ *
+ * or 0 to consume the event silently. A negative return is treated as
+ * CHIP_I2C_VERDICT_FORWARD. While a handler is attached the reflex map
+ * is not used.
+ */
+#define CHIP_I2C_VERDICT_WRITE      0x01
+#define CHIP_I2C_VERDICT_FORWARD    0x02
+
+struct chip_i2c_switch_handler {
+    int (*handle)(struct chip_i2c_switch_handler *handler,
+        struct device *dev, u8 old, u8 value, u8 *olat);
+    void *priv;
+};
+
+int chip_i2c_register_switch_handler(struct chip_i2c_switch_handler *handler);
+void chip_i2c_unregister_switch_handler(struct chip_i2c_switch_handler *handler);
+
+/* Asynchronous access for other drivers sharing the expander. A
+ * request is queued with chip_i2c_submit(), which never sleeps and
+ * can be called from atomic context. The driver runs it on the bus
+ * from a worker and then calls complete(), in process context. The
+ * request must stay around until then. Requests have the same
+ * limits as the rings: reads of the port and latch registers, writes
+ * of the led latch (OLATA). Writes go through the led policy like
+ * those of the chip_led file, and PORTB reads feed the switch change
+ * path like any other read.
+ *
+ * chip_i2c_read() and chip_i2c_write() are synchronous wrappers for
+ * callers that can sleep. dev is the chip's i2c client or spi device,
+ * e.g. from of_find_i2c_device_by_node(). The caller must make sure
+ * the device stays bound while it calls in, queued requests then pin
+ * the module and the device until they completed. The functions
+ * return -ENODEV once the device is being removed.
+ */
+struct chip_i2c_request {
+    u8 op;              /* CHIP_I2C_OP_* */
+    u8 reg;
+    u8 value;           /* value to write */
+    int result;         /* out: value read, 0 for writes, or -errno */
+    void (*complete)(struct chip_i2c_request *req);
+    void *context;      /* for the caller */
+    struct list_head node;  /* private to the driver */
+};
+
+int chip_i2c_submit(struct device *dev, struct chip_i2c_request *req);
+int chip_i2c_read(struct device *dev, u8 reg);
+int chip_i2c_write(struct device *dev, u8 reg, u8 value);
+
+#endif /* __KERNEL__ */
+
+#endif /* _CHIP_I2C_H */